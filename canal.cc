@@ -5,7 +5,15 @@
 #include <iostream>
 #include <exception>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <sys/types.h>
 
 #include "libpstack/proc.h"
@@ -46,48 +54,644 @@ globmatch(const string &pattern, const string &name)
     return globmatchR(pattern.c_str(), name.c_str());
 }
 
+/*
+ * The hits on one of the listed symbols. With -H, we also look at the glibc
+ * malloc chunk header before each object, and keep the number of objects
+ * that have a plausible one, the total size of their chunks, and counts of
+ * the chunk sizes in power-of-two buckets: bucket i has those from 2^i to
+ * 2^(i+1) - 1 bytes.
+ */
+struct SymbolHits {
+    static const size_t buckets = 64;
+    static const size_t unused = size_t(-1);
+    size_t symbol; // index in "listed", or "unused"
+    size_t count;
+    size_t sized;
+    Elf::Off bytes;
+    std::array<size_t, buckets> sizes;
+    SymbolHits() : symbol(unused), count(0), sized(0), bytes(0), sizes{} {}
+};
+
+/*
+ * SymbolHits keyed by symbol index, in an open-addressed table with linear
+ * probing. Only symbols with hits take space, so each worker can keep its
+ * own, however many symbols we're looking for.
+ */
+class HitTable {
+    vector<SymbolHits> slots; // a power of two of them, at most half used.
+    size_t used;
+public:
+    HitTable() : used(0) {}
+    SymbolHits &operator[](size_t symbol);
+    void merge(const HitTable &);
+    template <typename F> void forEach(F f) const {
+        for (auto &slot : slots)
+            if (slot.symbol != SymbolHits::unused)
+                f(slot);
+    }
+};
+
+SymbolHits &
+HitTable::operator[](size_t symbol)
+{
+    if (2 * (used + 1) > slots.size()) {
+        vector<SymbolHits> old(std::max(size_t(16), 2 * slots.size()));
+        old.swap(slots);
+        used = 0;
+        for (auto &slot : old)
+            if (slot.symbol != SymbolHits::unused)
+                (*this)[slot.symbol] = slot;
+    }
+    size_t mask = slots.size() - 1;
+    for (size_t i = (symbol * 0x9e3779b9) & mask;; i = (i + 1) & mask) {
+        auto &slot = slots[i];
+        if (slot.symbol == symbol)
+            return slot;
+        if (slot.symbol == SymbolHits::unused) {
+            slot.symbol = symbol;
+            used++;
+            return slot;
+        }
+    }
+}
+
+void
+HitTable::merge(const HitTable &other)
+{
+    other.forEach([this] (const SymbolHits &hits) {
+        auto &total = (*this)[hits.symbol];
+        total.count += hits.count;
+        total.sized += hits.sized;
+        total.bytes += hits.bytes;
+        for (size_t i = 0; i < SymbolHits::buckets; ++i)
+            total.sizes[i] += hits.sizes[i];
+    });
+}
+
 struct ListedSymbol {
     Elf::Sym sym;
     Elf::Off objbase;
     string name;
     size_t count;
     string objname;
+    const SymbolHits *hits; // once scanned, if we found any.
     ListedSymbol(const Elf::Sym &sym_, Elf::Off objbase_, string name_, string object)
         : sym(sym_)
         , objbase(objbase_)
         , name(name_)
         , count(0)
         , objname(object)
+        , hits(nullptr)
     {}
     Elf::Off memaddr() const { return  sym.st_value + objbase; }
 };
 
 class Usage {};
 
-bool operator < (const ListedSymbol &sym, Elf::Off addr) {
-    return sym.memaddr() + sym.sym.st_size < addr;
-}
-
 static const char *virtpattern = "_ZTV*"; /* wildcard for all vtbls */
 static bool compareSymbolsByAddress(const ListedSymbol &l, const ListedSymbol &r)
     { return l.memaddr() < r.memaddr(); }
 static bool compareSymbolsByFrequency(const ListedSymbol &l, const ListedSymbol &r)
     { return l.count > r.count; }
 
+/*
+ * A contiguous range of the process's memory to scan: "size" bytes at
+ * "vaddr", whose content is at "offset" in the reader we scan.
+ */
+struct Segment {
+    Elf::Addr vaddr;
+    Elf::Off offset;
+    Elf::Off size;
+    bool anonymous; // not from an ELF object, so it may hold malloc chunks.
+    size_t found; // number of hits in the segment, once scanned.
+};
+
+/*
+ * Finds any of a set of strings in a buffer. A single string is found with
+ * memmem, which skips quickly over the bytes that can't start a match. For
+ * several, we build an Aho-Corasick automaton, as a table of transitions
+ * for each state and byte, so one pass over the buffer finds them all.
+ */
+class StringSearch {
+    vector<string> strings;
+    size_t longest;
+    // Transitions are indexed by state * 256 + byte. State 0 is the start.
+    vector<uint32_t> next;
+    // The strings that end on reaching each state.
+    vector<vector<uint32_t>> matches;
+public:
+    StringSearch(const vector<string> &strings_);
+    bool empty() const { return strings.empty(); }
+    size_t size() const { return strings.size(); }
+    size_t maxLength() const { return longest; }
+    const string &operator[](size_t i) const { return strings[i]; }
+    // Call found(offset, string index) for each string that starts before
+    // "size" in data, in order of offset. There are "avail" bytes at data,
+    // so strings can run past "size".
+    template <typename F> void search(const char *data, size_t size, size_t avail, F found) const;
+};
+
+StringSearch::StringSearch(const vector<string> &strings_)
+    : strings(strings_)
+    , longest(0)
+{
+    for (auto &s : strings) {
+        if (s.empty())
+            throw (Exception() << "can't search for an empty string");
+        longest = std::max(longest, s.size());
+    }
+    if (strings.size() < 2)
+        return;
+
+    // Build the trie of the strings, with 0 for missing transitions.
+    next.assign(256, 0);
+    matches.resize(1);
+    for (uint32_t i = 0; i < strings.size(); ++i) {
+        uint32_t state = 0;
+        for (unsigned char c : strings[i]) {
+            if (next[state * 256 + c] == 0) {
+                next[state * 256 + c] = matches.size();
+                matches.emplace_back();
+                next.resize(next.size() + 256, 0);
+            }
+            state = next[state * 256 + c];
+        }
+        matches[state].push_back(i);
+    }
+
+    // Visiting states breadth first, point each missing transition where
+    // the failure link (the longest proper suffix of the state's text
+    // that's also in the trie) goes on that byte, and add the failure
+    // link's matches to the state's.
+    vector<uint32_t> fail(matches.size(), 0);
+    vector<uint32_t> queue;
+    for (unsigned c = 0; c < 256; ++c)
+        if (next[c] != 0)
+            queue.push_back(next[c]);
+    for (size_t q = 0; q < queue.size(); ++q) {
+        uint32_t state = queue[q];
+        auto &inherited = matches[fail[state]];
+        matches[state].insert(matches[state].end(), inherited.begin(), inherited.end());
+        for (unsigned c = 0; c < 256; ++c) {
+            uint32_t &to = next[state * 256 + c];
+            if (to != 0) {
+                fail[to] = next[fail[state] * 256 + c];
+                queue.push_back(to);
+            } else {
+                to = next[fail[state] * 256 + c];
+            }
+        }
+    }
+}
+
+template <typename F> void
+StringSearch::search(const char *data, size_t size, size_t avail, F found) const
+{
+    if (strings.size() == 1) {
+        const auto &s = strings[0];
+        for (const char *p = data, *end = data + avail;
+              (p = (const char *)memmem(p, end - p, s.data(), s.size())) != nullptr
+              && size_t(p - data) < size; ++p)
+            found(p - data, 0);
+        return;
+    }
+    // The automaton finds strings where they end, so sort them by start.
+    vector<pair<size_t, uint32_t>> hits;
+    uint32_t state = 0;
+    for (size_t off = 0; off < avail; ++off) {
+        state = next[state * 256 + (unsigned char)data[off]];
+        for (auto i : matches[state]) {
+            size_t start = off + 1 - strings[i].size();
+            if (start < size)
+                hits.emplace_back(start, i);
+        }
+    }
+    std::sort(hits.begin(), hits.end());
+    for (auto &hit : hits)
+        found(hit.first, hit.second);
+}
+
+/*
+ * Scans segments for pointers to the listed symbols, for pointers in the
+ * "searchaddrs" ranges, or for the strings in "findstrs". The segments are cut
+ * into large chunks, and a pool of workers takes chunks in turn, reading
+ * each with a single view or read of the reader, rather than a word at a
+ * time. Each worker counts hits for the symbols in its own HitTable, and
+ * merges it into ours when it's done. Output for each chunk is buffered,
+ * and written in address order.
+ */
+class Scanner {
+    const Reader &reader;
+    vector<ListedSymbol> &listed;
+    vector<pair<Elf::Off, Elf::Off>> ranges; // searchaddrs, sorted by start.
+    int symOffset;
+    bool showaddrs;
+    bool sizes; // find the malloc chunk sizes of objects.
+    StringSearch findstrs;
+    HitTable totals;
+
+    /*
+     * Most words in memory are nowhere near any symbol or range we're
+     * looking for. Words that are candidates are those in
+     * [filterLow, filterLow + filterSpan] with no bits in alignMask set,
+     * which we can check for a block of words at once in a loop the
+     * compiler can vectorise. Only candidates need the searches below.
+     */
+    Elf::Off filterLow;
+    Elf::Off filterSpan;
+    Elf::Off alignMask;
+
+    // The end addresses of the listed symbols, in Eytzinger order (the
+    // layout of a binary heap, from index 1), so a search touches few
+    // cache lines and needs no unpredictable branches, with the index in
+    // "listed" of the symbol for each.
+    vector<Elf::Off> symbolEnds;
+    vector<size_t> symbolIndexes;
+    size_t eytzinger(const vector<Elf::Off> &ends, size_t i, size_t k);
+    size_t findSymbol(Elf::Off p) const;
+
+    // rangeEnds[i] is the highest end of ranges[0..i], so we can stop
+    // looking back through the ranges for those containing an address once
+    // it's past all their ends.
+    vector<Elf::Off> rangeEnds;
+
+    static const Elf::Off chunkSize = 16 * 1024 * 1024;
+    struct Chunk {
+        Segment *segment;
+        Elf::Off start; // offset of the chunk within its segment.
+        Elf::Off size;
+        size_t found;
+        bool done;
+        string output;
+    };
+    vector<Chunk> chunks;
+    std::atomic<size_t> nextChunk;
+    // Protects totals, "done" and "output" in the chunks, and nextOutput.
+    std::mutex lock;
+    size_t nextOutput;
+
+    // The "avail" bytes at "data", read from "vaddr" in "segment".
+    struct Window {
+        const Segment &segment;
+        Elf::Addr vaddr;
+        const char *data;
+        size_t avail;
+    };
+
+    void work(ostream &os);
+    size_t scanChunk(const Window &window, size_t size, Elf::Off before,
+          HitTable &hits, ostream &os) const;
+    size_t classify(Elf::Off p, Elf::Addr loc, Elf::Off before, const Window &window,
+          HitTable &hits, ostream &os) const;
+    Elf::Off mallocChunkSize(Elf::Addr loc, Elf::Off field, const Window &window) const;
+public:
+    Scanner(const Reader &reader_, vector<ListedSymbol> &listed_,
+          const vector<pair<Elf::Off, Elf::Off>> &searchaddrs,
+          int symOffset_, bool showaddrs_, bool sizes_, const vector<string> &findstrs_);
+    void scan(vector<Segment> &segments, unsigned workers, ostream &os);
+};
+
+const Elf::Off Scanner::chunkSize;
+
+Scanner::Scanner(const Reader &reader_, vector<ListedSymbol> &listed_,
+      const vector<pair<Elf::Off, Elf::Off>> &searchaddrs,
+      int symOffset_, bool showaddrs_, bool sizes_, const vector<string> &findstrs_)
+    : reader(reader_)
+    , listed(listed_)
+    , ranges(searchaddrs)
+    , symOffset(symOffset_)
+    , showaddrs(showaddrs_)
+    , sizes(sizes_)
+    , findstrs(findstrs_)
+    , nextChunk(0)
+    , nextOutput(0)
+{
+    // An empty filter passes nothing but 1, which the searches reject.
+    Elf::Off low = std::numeric_limits<Elf::Off>::max();
+    Elf::Off high = 0;
+    if (!ranges.empty()) {
+        std::sort(ranges.begin(), ranges.end());
+        Elf::Off end = 0;
+        for (auto &range : ranges) {
+            end = std::max(end, range.second);
+            rangeEnds.push_back(end);
+            if (range.first < range.second) {
+                low = std::min(low, range.first);
+                high = std::max(high, range.second - 1);
+            }
+        }
+        alignMask = 3;
+    } else {
+        // A hit is within the symbol found by findSymbol, or at symOffset
+        // from its start, which can be its end.
+        vector<Elf::Off> ends;
+        for (auto &sym : listed) {
+            Elf::Off start = sym.memaddr();
+            Elf::Off end = start + sym.sym.st_size;
+            ends.push_back(end);
+            if (symOffset != -1)
+                start = end = start + symOffset;
+            low = std::min(low, start);
+            high = std::max(high, end);
+        }
+        symbolEnds.resize(ends.size() + 1);
+        symbolIndexes.resize(ends.size() + 1);
+        eytzinger(ends, 0, 1);
+        alignMask = 0;
+    }
+    if (low > high) {
+        filterLow = 1;
+        filterSpan = 0;
+    } else {
+        filterLow = low;
+        filterSpan = high - low;
+    }
+}
+
+/*
+ * Fill in the subtree of symbolEnds at "k" with the sorted "ends" from
+ * "i", returning the index of the first one not used.
+ */
+size_t
+Scanner::eytzinger(const vector<Elf::Off> &ends, size_t i, size_t k)
+{
+    if (k < symbolEnds.size()) {
+        i = eytzinger(ends, i, 2 * k);
+        symbolEnds[k] = ends[i];
+        symbolIndexes[k] = i++;
+        i = eytzinger(ends, i, 2 * k + 1);
+    }
+    return i;
+}
+
+/*
+ * Find the index in "listed" of the first symbol whose end is at or after
+ * "p", as lower_bound would, or -1 if there's none.
+ */
+size_t
+Scanner::findSymbol(Elf::Off p) const
+{
+    size_t k = 1;
+    while (k < symbolEnds.size())
+        k = 2 * k + (symbolEnds[k] < p);
+    // Undo the right turns we took after the last left turn, and that one.
+    k >>= __builtin_ffsll(~(unsigned long long)k);
+    return k == 0 ? size_t(-1) : symbolIndexes[k];
+}
+
+void
+Scanner::scan(vector<Segment> &segments, unsigned workers, ostream &os)
+{
+    chunks.clear();
+    for (auto &segment : segments)
+        for (Elf::Off start = 0; start < segment.size; start += chunkSize)
+            chunks.push_back(Chunk{ &segment, start,
+                  std::min(chunkSize, segment.size - start), 0, false, string() });
+    nextChunk = 0;
+    nextOutput = 0;
+
+    vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(size_t(workers), chunks.size()); ++i)
+        pool.emplace_back([this, &os] { work(os); });
+    work(os);
+    for (auto &t : pool)
+        t.join();
+
+    for (auto &segment : segments)
+        segment.found = 0;
+    for (auto &chunk : chunks)
+        chunk.segment->found += chunk.found;
+    totals.forEach([this] (const SymbolHits &hits) {
+        listed[hits.symbol].count = hits.count;
+        listed[hits.symbol].hits = &hits;
+    });
+    os.flush();
+}
+
+void
+Scanner::work(ostream &os)
+{
+    HitTable hits;
+    vector<char> buf;
+    for (size_t i; (i = nextChunk++) < chunks.size(); ) {
+        auto &chunk = chunks[i];
+        const auto &segment = *chunk.segment;
+        // A string found in the chunk may end in the bytes after it.
+        Elf::Off avail = std::min(chunk.size + (findstrs.empty() ? 0 : findstrs.maxLength() - 1),
+              segment.size - chunk.start);
+        std::ostringstream out;
+        try {
+            const char *data = reader.view(segment.offset + chunk.start, avail);
+            if (data == nullptr) {
+                buf.resize(avail);
+                avail = reader.read(segment.offset + chunk.start, avail, buf.data());
+                data = buf.data();
+            }
+            // The word before the chunk, for the malloc header of an object
+            // at its start.
+            Elf::Off before = 0;
+            if (sizes && chunk.start >= sizeof before)
+                reader.read(segment.offset + chunk.start - sizeof before,
+                      sizeof before, (char *)&before);
+            Window window { segment, segment.vaddr + chunk.start, data, avail };
+            chunk.found = scanChunk(window, std::min(chunk.size, avail), before, hits, out);
+        }
+        catch (const std::exception &ex) {
+            IOFlagSave _(clog);
+            clog << "can't scan " << hex << chunk.size << " bytes at 0x"
+                << segment.vaddr + chunk.start << ": " << ex.what() << "\n";
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        chunk.output = out.str();
+        chunk.done = true;
+        for (; nextOutput < chunks.size() && chunks[nextOutput].done; ++nextOutput) {
+            os << chunks[nextOutput].output;
+            chunks[nextOutput].output = string();
+        }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    totals.merge(hits);
+}
+
+/*
+ * Scan the first "size" bytes of "window". Strings that start within
+ * "size" can run past it, into the rest of the window. "before" is the word
+ * before the window in the process.
+ */
+size_t
+Scanner::scanChunk(const Window &window, size_t size, Elf::Off before,
+      HitTable &hits, ostream &os) const
+{
+    size_t found = 0;
+    Elf::Addr vaddr = window.vaddr;
+    const char *data = window.data;
+    if (!findstrs.empty()) {
+        findstrs.search(data, size, window.avail, [&] (size_t off, size_t i) {
+            IOFlagSave _(os);
+            os << "0x" << hex << vaddr + off;
+            // Name the string we found if there's a choice.
+            if (findstrs.size() > 1)
+                os << " " << findstrs[i];
+            os << "\n";
+            found++;
+        });
+        return found;
+    }
+    const size_t block = 8;
+    size_t words = size / sizeof (Elf::Off);
+    for (size_t word = 0; word < words; word += block) {
+        Elf::Off p[block] = {};
+        size_t count = std::min(block, words - word);
+        memcpy(p, data + word * sizeof p[0], count * sizeof p[0]);
+        unsigned candidates = 0;
+        for (size_t i = 0; i < block; ++i)
+            candidates |= unsigned(p[i] - filterLow <= filterSpan && (p[i] & alignMask) == 0) << i;
+        candidates &= (1U << count) - 1;
+        while (candidates != 0) {
+            size_t i = __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            found += classify(p[i], vaddr + (word + i) * sizeof p[0],
+                  i == 0 ? before : p[i - 1], window, hits, os);
+        }
+        before = p[count - 1];
+    }
+    return found;
+}
+
+/*
+ * Count and report the word "p" at "loc" if it's a pointer we're looking
+ * for, returning the number of hits. "before" is the word before it, which
+ * is the malloc chunk's size if "p" is at the start of an allocation.
+ */
+size_t
+Scanner::classify(Elf::Off p, Elf::Addr loc, Elf::Off before, const Window &window,
+      HitTable &hits, ostream &os) const
+{
+    size_t found = 0;
+    if (!ranges.empty()) {
+        // Look back from the last range starting at or before p, until
+        // none of the ranges left can reach it.
+        auto first = std::upper_bound(ranges.begin(), ranges.end(),
+              make_pair(p, std::numeric_limits<Elf::Off>::max()));
+        for (size_t i = first - ranges.begin(); i-- > 0 && rangeEnds[i] > p; ) {
+            if (p < ranges[i].second) {
+                IOFlagSave _(os);
+                os << "0x" << hex << loc << "\n";
+                found++;
+            }
+        }
+        return found;
+    }
+    size_t idx = findSymbol(p);
+    if (idx == size_t(-1))
+        return 0;
+    auto &sym = listed[idx];
+    if (symOffset != -1
+          ? sym.memaddr() + symOffset == p
+          : sym.memaddr() <= p && sym.memaddr() + sym.sym.st_size > p) {
+        if (showaddrs)
+            os
+                << sym.name << " 0x" << std::hex << loc
+                << std::dec <<  " ... size=" << sym.sym.st_size
+                << ", diff=" << p - sym.memaddr() << endl;
+        auto &symHits = hits[idx];
+        symHits.count++;
+        if (sizes && window.segment.anonymous) {
+            Elf::Off size = mallocChunkSize(loc, before, window);
+            if (size != 0) {
+                symHits.sized++;
+                symHits.bytes += size;
+                symHits.sizes[63 - __builtin_clzll(size)]++;
+            }
+        }
+        found++;
+    }
+    return found;
+}
+
+/*
+ * The size of the glibc malloc chunk holding an object at "loc", given its
+ * size field, "field", the word before the object, or 0 if the field's not
+ * plausible. The chunk must fit in the segment, and be in use: the next
+ * chunk's PREV_INUSE bit must be set, or, if the chunk was mmapped, it must
+ * be a whole number of pages, as there's no next chunk.
+ */
+Elf::Off
+Scanner::mallocChunkSize(Elf::Addr loc, Elf::Off field, const Window &window) const
+{
+    const Elf::Off prevInuse = 1, isMmapped = 2, flags = 7; // and NON_MAIN_ARENA
+    const Elf::Off word = sizeof field;
+    const auto &segment = window.segment;
+    Elf::Off size = field & ~flags;
+    // The chunk starts with the previous chunk's size, then its own.
+    Elf::Addr chunk = loc - 2 * word;
+    if (size < 4 * word || size % (2 * word) != 0 || chunk < segment.vaddr
+          || size > segment.vaddr + segment.size - chunk)
+        return 0;
+    if (field & isMmapped)
+        return size % 4096 == 0 ? size : 0;
+    Elf::Addr next = chunk + size + word; // the next chunk's size field.
+    if (next + word > segment.vaddr + segment.size)
+        return 0;
+    Elf::Off nextField;
+    if (next >= window.vaddr && next + word <= window.vaddr + window.avail) {
+        memcpy(&nextField, window.data + (next - window.vaddr), word);
+    } else {
+        try {
+            reader.readObj(segment.offset + (next - segment.vaddr), &nextField);
+        }
+        catch (const std::exception &) {
+            return 0;
+        }
+    }
+    return (nextField & prevInuse) != 0 ? size : 0;
+}
+
 ostream &
 operator <<(ostream &os, const Usage &)
 {
    return os
-      << "usage: canal [options] <executable> <core>" << endl
+      << "usage: canal [options] [<executable>] <core|pid>" << endl
       << "options:" << endl
       << "\t-p <pattern>: use a specific pattern to search (default " << virtpattern << ") (repeatable)" << endl
       << "\t-s: show the address of each located object" << endl
       << "\t-v: verbose (repeat for more verbosity)" << endl
       << "\t-h: this message" << endl
       << "\t-r <prefix=path>: replace 'prefix' in core with 'path' when loading shared libraries" << endl
+      << "\t-S <string>: find occurrences of a string, rather than pointers (repeatable)" << endl
+      << "\t-H: show the sizes of objects, from their malloc chunk headers" << endl
+      << "\t-F: scan a live process without stopping it, for fuzzy statistics" << endl
+      << "\t-w <workers>: scan with this many threads (default: one per CPU)" << endl
       ;
 }
 
+/*
+ * The writable mappings of the live process "pid", from /proc/<pid>/maps.
+ * That's where its heap, stacks and data are. We read the process's memory
+ * at its addresses, so the offset of each is its address.
+ */
+static vector<Segment>
+writableMappings(pid_t pid)
+{
+    vector<Segment> segments;
+    std::ifstream maps(procname(pid, "maps"));
+    string line;
+    while (std::getline(maps, line)) {
+        // Lines start "<start>-<end> <perms> ...", with addresses in hex.
+        std::istringstream fields(line);
+        Elf::Addr start, end;
+        char dash;
+        string perms;
+        if (!(fields >> hex >> start >> dash >> end >> perms) || dash != '-')
+            continue;
+        if (perms.compare(0, 2, "rw") == 0 && end > start)
+            segments.push_back(Segment{ start, start, end - start, false, 0 });
+    }
+    if (segments.empty())
+        throw (Exception() << "can't find writable mappings for process " << pid);
+    return segments;
+}
+
 int
 mainExcept(int argc, char *argv[])
 {
@@ -104,16 +708,17 @@ mainExcept(int argc, char *argv[])
     bool showaddrs = false;
     bool showsyms = false;
     int rate = 1;
+    unsigned workers = std::max(std::thread::hardware_concurrency(), 1U);
 
     std::vector<std::pair<Elf::Off, Elf::Off>> searchaddrs;
     std::vector<std::pair<std::string, std::string>> pathReplacements;
-    char *strbuf = 0;
-    char *findstr = 0;
-    size_t findstrlen = 0;
+    vector<string> findstrs;
     int symOffset = -1;
     bool showloaded = false;
+    bool fuzzy = false;
+    bool sizes = false;
 
-    while ((c = getopt(argc, argv, "o:vhr:sp:f:Pe:S:R:K:lVt")) != -1) {
+    while ((c = getopt(argc, argv, "o:vhr:sp:f:Pe:S:R:K:lVtw:FH")) != -1) {
         switch (c) {
 #ifdef WITH_PYTHON
             case 'P':
@@ -152,9 +757,7 @@ mainExcept(int argc, char *argv[])
             }
 
             case 'S':
-                findstr = optarg;
-                findstrlen = strlen(findstr);
-                strbuf = new char[findstrlen];
+                findstrs.push_back(optarg);
                 break;
 
             case 'f': {
@@ -205,6 +808,20 @@ mainExcept(int argc, char *argv[])
             case 'l':
                 showloaded = true;
                 break;
+
+            case 'F':
+                fuzzy = true;
+                break;
+
+            case 'H':
+                sizes = true;
+                break;
+
+            case 'w':
+                workers = atoi(optarg);
+                if (workers == 0)
+                    throw (Exception() << "need at least one worker for -w");
+                break;
         }
     }
 
@@ -224,7 +841,15 @@ mainExcept(int argc, char *argv[])
        std::clog << "attaching to live process" << std::endl;
        process = make_shared<LiveProcess>(exec, pid, pathReplacements, imageCache);
     } else {
-       core = make_shared<Elf::Object>(imageCache, loadFile(argv[optind]));
+       // Map the core if we can, so we scan its segments in place.
+       Reader::csptr coreData;
+       try {
+           coreData = make_shared<MmapReader>(argv[optind]);
+       }
+       catch (const std::exception &) {
+           coreData = loadFile(argv[optind]);
+       }
+       core = make_shared<Elf::Object>(imageCache, coreData);
        process = make_shared<CoreProcess>(exec, core, pathReplacements, imageCache);
     }
     process->load(PstackOptions());
@@ -273,85 +898,98 @@ mainExcept(int argc, char *argv[])
        exit(0);
     sort(listed.begin() , listed.end() , compareSymbolsByAddress);
 
-    // Now run through the corefile, searching for virtual objects.
+    // Now run through the corefile or process, searching for virtual objects.
     Elf::Off filesize = 0;
     Elf::Off memsize = 0;
-#ifdef WITH_PYTHON
-    PythonPrinter<2> py(*process, std::cout, PstackOptions());
-#endif
-    for (auto &hdr : core->getSegments(PT_LOAD)) {
-        Elf::Off p;
-        filesize += hdr.p_filesz;
-        memsize += hdr.p_memsz;
-        int seg_count = 0;
-        if (verbose) {
-            IOFlagSave _(*debug);
-            *debug << "scan " << hex << hdr.p_vaddr <<  " to " << hdr.p_vaddr + hdr.p_memsz
-                << " (filesiz = " << hdr.p_filesz  << ", memsiz=" << hdr.p_memsz << ") ";
-        }
-
-        if (findstr) {
-            for (auto loc = hdr.p_vaddr; loc < hdr.p_vaddr + hdr.p_filesz - findstrlen; loc++) {
-                size_t rc = process->io->read(loc, findstrlen, strbuf);
-                assert(rc == findstrlen);
-                if (memcmp(strbuf, findstr, rc) == 0) {
-                    IOFlagSave _(cout);
-                    std::cout << "0x" << hex << loc << "\n";
-                }
+    std::vector<Segment> segments;
+    Reader::csptr memory;
+    std::unique_ptr<StopProcess> stopped;
+    if (core) {
+        for (auto &hdr : core->getSegments(PT_LOAD)) {
+            filesize += hdr.p_filesz;
+            memsize += hdr.p_memsz;
+            if (verbose) {
+                IOFlagSave _(*debug);
+                *debug << "scan " << hex << hdr.p_vaddr <<  " to " << hdr.p_vaddr + hdr.p_memsz
+                    << " (filesiz = " << hdr.p_filesz  << ", memsiz=" << hdr.p_memsz << ")\n";
             }
-        } else {
-            for (auto loc = hdr.p_vaddr; loc < hdr.p_vaddr + hdr.p_filesz; loc += sizeof p) {
-                // log a '.' every megabyte.
-                if (verbose && (loc - hdr.p_vaddr) % (1024 * 1024) == 0)
-                    clog << '.';
-                process->io->readObj(loc, &p);
-                if (searchaddrs.size()) {
-                    for (auto range = searchaddrs.begin(); range != searchaddrs.end(); ++range) {
-                        if (p >= range->first && p < range->second && (p % 4 == 0)) {
-                            IOFlagSave _(cout);
-                            cout << "0x" << hex << loc << "\n";
-                        }
-                    }
-                } else {
-                    auto found = lower_bound(listed.begin(), listed.end(), p);
-                    if (found != listed.end() &&
-                            (symOffset != -1
-                                ? found->memaddr() + symOffset == p
-                                : found->memaddr() <= p && found->memaddr() +
-                                               found->sym.st_size > p)) {
-                        if (showaddrs)
-                            cout
-                                << found->name << " 0x" << std::hex << loc
-                                << std::dec <<  " ... size=" << found->sym.st_size
-                                << ", diff=" << p - found->memaddr() << endl;
-#if 0 && WITH_PYTHON
-                        if (doPython) {
-                            std::cout << "pyo " << Elf::Addr(loc) << " ";
-                            py.print(Elf::Addr(loc) - sizeof (PyObject) +
-                                  sizeof (struct _typeobject *));
-                            std::cout << "\n";
-                        }
-#endif
-                        found->count++;
-                        seg_count++;
-                    }
-                }
+            segments.push_back(Segment{ hdr.p_vaddr, hdr.p_offset, hdr.p_filesz, false, 0 });
+        }
+        memory = core->io;
+    } else {
+        // Keep the process stopped while we find and scan its mappings, so
+        // we see a consistent heap, unless the user will settle for fuzzy
+        // statistics rather than stop it for that long.
+        if (!fuzzy)
+            stopped.reset(new StopProcess(process.get()));
+        segments = writableMappings(pid);
+        for (auto &segment : segments) {
+            filesize += segment.size;
+            if (verbose) {
+                IOFlagSave _(*debug);
+                *debug << "scan " << hex << segment.vaddr << " to "
+                    << segment.vaddr + segment.size << "\n";
             }
         }
-
-        if (verbose)
-            *debug << seg_count << endl;
-
+        memsize = filesize;
+        memory = make_shared<ProcessVMReader>(pid);
+    }
+    // Only memory that's not part of a loaded object can hold malloc chunks:
+    // there's nothing to learn from the words before objects in .data. The
+    // mappings are page-aligned, so an object's segment might not cover
+    // either end of its mapping: check both.
+    auto inObject = [&](Elf::Addr addr) {
+        return std::get<1>(process->findSegment(addr)) != nullptr;
+    };
+    for (auto &segment : segments)
+        segment.anonymous = segment.size != 0 && !inObject(segment.vaddr)
+            && !inObject(segment.vaddr + segment.size - 1);
+
+    Scanner scanner(*memory, listed, searchaddrs, symOffset, showaddrs, sizes, findstrs);
+    auto start = std::chrono::steady_clock::now();
+    scanner.scan(segments, workers, cout);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (stopped) {
+        stopped.reset();
+        clog << "process was stopped for " << dec << process->lastStopDuration
+            << " microseconds\n";
+    }
+    {
+        IOFlagSave _(clog);
+        double gb = filesize / double(1024 * 1024 * 1024);
+        clog << "scanned " << std::fixed << std::setprecision(2) << gb << "GB in "
+            << elapsed.count() << "s (" << gb / elapsed.count() << "GB/s) with "
+            << workers << " workers\n";
+    }
+    if (verbose) {
+        for (size_t i = 0; i < segments.size(); ++i) {
+            IOFlagSave _(*debug);
+            *debug << "found " << dec << segments[i].found << " in segment at " << hex
+                << segments[i].vaddr << "\n";
+        }
+        if (core)
+            *debug << "core file contains " << dec << filesize << " out of "
+               << memsize << " bytes of memory\n";
     }
-    if (verbose)
-        *debug << "core file contains " << filesize << " out of "
-           << memsize << " bytes of memory\n";
 
     sort(listed.begin() , listed.end() , compareSymbolsByFrequency);
 
-    for (auto &i : listed)
-        if (i.count)
-            cout << dec << i.count << " " << i.name << " ( from " << i.objname << ")" << endl;
+    for (auto &i : listed) {
+        if (!i.count)
+            continue;
+        cout << dec << i.count << " " << i.name << " ( from " << i.objname << ")" << endl;
+        if (sizes) {
+            auto &hits = *i.hits;
+            cout << "\t" << hits.bytes << " bytes in " << hits.sized << " malloc chunks";
+            if (hits.sized != hits.count)
+                cout << ", " << hits.count - hits.sized << " objects without a chunk header";
+            cout << "\n";
+            for (size_t b = 0; b < SymbolHits::buckets; ++b)
+                if (hits.sizes[b])
+                    cout << "\t\t" << (Elf::Off(1) << b) << "-" << (Elf::Off(2) << b) - 1
+                        << " bytes: " << hits.sizes[b] << "\n";
+        }
+    }
     return 0;
 }
 
@@ -121,6 +121,17 @@ CoreProcess::getRegs(lwpid_t pid, Elf::CoreRegisters *reg)
    return false;
 }
 
+bool
+CoreProcess::findMapping(Elf::Addr addr, Elf::Addr *start, Elf::Addr *end) const
+{
+    auto hdr = coreImage->getSegmentForAddress(addr);
+    if (hdr == nullptr)
+        return false;
+    *start = hdr->p_vaddr;
+    *end = hdr->p_vaddr + hdr->p_memsz;
+    return true;
+}
+
 void
 CoreProcess::resume(pid_t /* unused */)
 {
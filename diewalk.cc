@@ -0,0 +1,48 @@
+/*
+ * Measure DWARF decoding throughput: parse the debug info of an ELF object,
+ * and walk every DIE of every unit, reporting how many there were, and how
+ * long it took. Each file is loaded as "loadFile" would, through a
+ * CacheReader over a FileReader, so DWARFReader can't view its content
+ * directly, and decodes through its local window.
+ */
+#include "libpstack/dwarf.h"
+
+#include <chrono>
+#include <iostream>
+
+static size_t
+walk(const Dwarf::DIE &die)
+{
+    size_t count = 1;
+    for (auto child : die.children())
+        count += walk(child);
+    return count;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        std::clog << "usage: " << argv[0] << " <elf object> [<runs>]\n";
+        return 1;
+    }
+    int runs = argc > 2 ? atoi(argv[2]) : 1;
+    try {
+        for (int i = 0; i < runs; ++i) {
+            Dwarf::ImageCache cache;
+            auto obj = std::make_shared<Elf::Object>(cache, loadFile(argv[1]));
+            auto start = std::chrono::steady_clock::now();
+            auto info = std::make_shared<Dwarf::Info>(obj, cache);
+            size_t count = 0;
+            for (const auto &unit : info->getUnits())
+                count += walk(unit->root());
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << count << " DIEs in " << elapsed.count() << "s\n";
+        }
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "exception: " << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
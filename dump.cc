@@ -228,13 +228,12 @@ std::ostream &operator << (std::ostream &os, const JSON<Dwarf::FileEntry> &jobj)
         .field("lastmod", fe.lastMod);
 }
 
-template <typename C>
-std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineState, C> &jo) {
-    auto &ls = jo.object;
+std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineRow, const Dwarf::LineInfo *> &jo) {
+    auto &row = jo.object;
     return JObject(os)
-        .field("file", *ls.file)
-        .field("line", ls.line)
-        .field("addr", ls.addr);
+        .field("file", jo.context->files[row.file])
+        .field("line", row.line)
+        .field("addr", row.addr);
 }
 
 template <typename C>
@@ -246,7 +245,7 @@ std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineInfo, C> &jo)
         .field("opcode_lengths", lines.opcode_lengths)
         .field("files", lines.files)
         .field("directories", lines.directories)
-        .field("matrix", lines.matrix);
+        .field("matrix", lines.matrix, &lines);
 }
 
 template <typename C>
@@ -485,7 +484,7 @@ operator << (std::ostream &os, const JSON<Dwarf::CFI> &info)
        ciesByString(info.object.cies);
     return JObject(os)
         .field("cielist", ciesByString, &info.object)
-        .field("fdelist", info.object.fdeList, &info.object);
+        .field("fdelist", info.object.getFDEs(), &info.object);
 }
 
 std::ostream &
@@ -2,6 +2,7 @@
 
 #include "libpstack/elf.h"
 #include "libpstack/dwarf.h"
+#include "libpstack/indexcache.h"
 #include "libpstack/inflatereader.h"
 
 #include <elf.h>
@@ -14,6 +15,7 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <set>
@@ -52,18 +54,50 @@ Stats stats;
 }
 
 namespace Dwarf {
+/*
+ * RawDIEs, and their attribute values, are allocated from an arena owned by
+ * their unit. They are never individually destroyed: the arena is freed
+ * wholesale when the unit is purged, and the last DIE referring to it goes
+ * away.
+ */
+class DIEArena {
+    DIEArena(const DIEArena &) = delete;
+    static const size_t CHUNKSIZE = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char *next;
+    size_t avail;
+public:
+    int dieCount;
+    DIEArena() : next(nullptr), avail(0), dieCount(0) {}
+    ~DIEArena() { stats.currentDIEs -= dieCount; }
+    template <typename T> T *alloc(size_t count = 1) {
+        static_assert(alignof(T) <= alignof(uintmax_t), "arena alignment");
+        size_t size = (count * sizeof (T) + alignof(uintmax_t) - 1) & ~(alignof(uintmax_t) - 1);
+        if (size > avail) {
+            avail = std::max(size, CHUNKSIZE);
+            chunks.emplace_back(new char[avail]);
+            next = chunks.back().get();
+        }
+        auto p = next;
+        next += size;
+        avail -= size;
+        return reinterpret_cast<T *>(p);
+    }
+};
+
+const size_t DIEArena::CHUNKSIZE;
+
 class RawDIE {
     RawDIE() = delete;
     RawDIE(const RawDIE &) = delete;
     static void readValue(DWARFReader &, const FormEntry &form, Value &value, Unit *);
     const Abbreviation *type;
-    std::vector<Value> values;
+    Value *values; // one per form in type, allocated from the unit's arena.
     Elf::Off parent; // 0 implies we do not yet know the parent's offset.
     Elf::Off firstChild;
     Elf::Off nextSibling;
 public:
-    RawDIE(Unit *, DWARFReader &, size_t, Elf::Off parent);
-    ~RawDIE();
+    RawDIE(Unit *, DIEArena &, DWARFReader &, size_t, Elf::Off parent);
     friend class Attribute;
     friend class DIE;
     friend class DIEAttributes;
@@ -71,6 +105,28 @@ public:
     friend class DIEIter;
 };
 
+/*
+ * An index of the addresses covered by the subprograms and inlined
+ * subroutines in a unit. "ranges" is sorted and disjoint, and maps each
+ * address range to the most deeply nested entry that covers it. Following the
+ * entry's parent links gives the entries enclosing it.
+ */
+struct UnitAddrIndex {
+    struct Entry {
+        Elf::Off offset;
+        Tag tag;
+        int parent;
+    };
+    struct Range {
+        Elf::Addr low;
+        Elf::Addr high;
+        int entry;
+    };
+    std::vector<Entry> entries;
+    std::vector<Range> ranges;
+    UnitAddrIndex(const Unit::sptr &);
+};
+
 DIEIter &DIEIter::operator++() {
     currentDIE = currentDIE.nextSibling(parent);
     // if we loaded the child by a direct refrence into the middle of the
@@ -91,13 +147,49 @@ DIEIter::DIEIter(const DIE &first, const DIE & parent_)
         currentDIE.raw->parent = parent.offset;
 }
 
+const size_t DWARFReader::MINWINDOW;
+const size_t DWARFReader::MAXWINDOW;
+
+/*
+ * Refill the window from the underlying reader so it starts at the current
+ * offset and contains at least "len" bytes. Returns false if that's not
+ * possible, and the caller should fall back to reading directly.
+ */
+bool
+DWARFReader::fill(size_t len)
+{
+    if (viewed)
+        return false;
+    size_t want = std::max(len, size_t(std::min(Elf::Off(nextFill), end > off ? end - off : 0)));
+    unsigned char *buf;
+    if (want <= sizeof smallWindow) {
+        buf = smallWindow;
+    } else {
+        if (window.size() < want)
+            window.resize(want);
+        buf = window.data();
+    }
+    nextFill = std::min(nextFill * 2, MAXWINDOW);
+    size_t got;
+    try {
+        got = io->read(off, want, (char *)buf);
+    }
+    catch (const std::exception &) {
+        got = 0;
+    }
+    winData = buf;
+    winStart = off;
+    winEnd = off + got;
+    return got >= len;
+}
+
 uintmax_t
 DWARFReader::getuleb128shift(int &shift, bool &msb)
 {
     uintmax_t result;
     unsigned char byte;
     for (result = 0, shift = 0;;) {
-        io->readObj(off++, &byte);
+        byte = getu8();
         result |= uintmax_t(byte & 0x7f) << shift;
         shift += 7;
         if ((byte & 0x80) == 0)
@@ -184,13 +276,14 @@ Info::Info(Elf::Object::sptr obj, ImageCache &cache_)
     , haveLines(bool(lineshdr))
     , haveARanges(bool(arangesh))
 {
-    auto f = [this, &obj](const char *name, const char *zname, FIType ftype) {
+    auto f = [this, &obj](const char *name, const char *zname, FIType ftype,
+            const Elf::Section *hdr) {
         const Elf::Section *sec;
         auto io = sectionReader(*obj, name, zname, &sec);
         if (!io)
             return std::unique_ptr<CFI>();
         try {
-            return make_unique<CFI>(this, sec->shdr.sh_addr, io, ftype);
+            return make_unique<CFI>(this, sec->shdr.sh_addr, io, ftype, hdr);
         }
         catch (const Exception &ex) {
             *debug << "can't decode " << name << " for " << *obj->io << ": "
@@ -198,8 +291,9 @@ Info::Info(Elf::Object::sptr obj, ImageCache &cache_)
         }
         return std::unique_ptr<CFI>();
     };
-    ehFrame = f(".eh_frame", nullptr, FI_EH_FRAME);
-    debugFrame = f(".debug_frame", ".zdebug_frame", FI_DEBUG_FRAME);
+    const auto &ehFrameHdr = obj->getSection(".eh_frame_hdr", SHT_PROGBITS);
+    ehFrame = f(".eh_frame", nullptr, FI_EH_FRAME, ehFrameHdr ? &ehFrameHdr : nullptr);
+    debugFrame = f(".debug_frame", ".zdebug_frame", FI_DEBUG_FRAME, nullptr);
 }
 
 const std::list<PubnameUnit> &
@@ -332,9 +426,12 @@ bool Info::hasARanges() const {
 Unit::sptr
 Info::lookupUnit(Elf::Addr addr) const {
     if (arangesh) {
-        DWARFReader r(arangesh);
-        while (!r.empty())
-            decodeARangeSet(r);
+        if (!loadARanges("aranges")) {
+            DWARFReader r(arangesh);
+            while (!r.empty())
+                decodeARangeSet(r);
+            storeARanges("aranges");
+        }
         arangesh = nullptr;
     }
     auto it = aranges.ranges.upper_bound(addr);
@@ -346,20 +443,23 @@ Info::lookupUnit(Elf::Addr addr) const {
         // the aranges, walk through all the units, and check out their
         // DW_AT_range attribute, and fold its content into the aranges data.
         unitRangesCached = true;
-        for (auto u : getUnits()) {
-            auto root = u->root();
-            auto lowpc = root.attribute(DW_AT_low_pc);
-            auto highpc = root.attribute(DW_AT_high_pc);
-            auto ranges = root.attribute(DW_AT_ranges);
-            if (lowpc.valid() && highpc.valid()) {
-                aranges.ranges[uintmax_t(highpc)] = std::make_pair(uintmax_t(highpc) - uintmax_t(lowpc), u->offset);
-            }
-            if (ranges.valid()) {
-                auto rs = rangesAt(uintmax_t(ranges));
-                for (auto r : rs) {
-                    aranges.ranges[r.second] = std::make_pair(r.first, u->offset);
+        if (!loadARanges("unitranges")) {
+            for (auto u : getUnits()) {
+                auto root = u->root();
+                auto lowpc = root.attribute(DW_AT_low_pc);
+                auto highpc = root.attribute(DW_AT_high_pc);
+                auto ranges = root.attribute(DW_AT_ranges);
+                if (lowpc.valid() && highpc.valid()) {
+                    aranges.ranges[uintmax_t(highpc)] = std::make_pair(uintmax_t(highpc) - uintmax_t(lowpc), u->offset);
+                }
+                if (ranges.valid()) {
+                    auto rs = rangesAt(uintmax_t(ranges));
+                    for (auto r : rs) {
+                        aranges.ranges[r.second] = std::make_pair(r.first, u->offset);
+                    }
                 }
             }
+            storeARanges("unitranges");
         }
     }
 
@@ -373,6 +473,62 @@ Info::lookupUnit(Elf::Addr addr) const {
 
 Info::~Info() = default;
 
+// Records for indexes we keep in the Elf::IndexCache
+namespace {
+struct CachedARange {
+    Elf::Addr end;
+    Elf::Addr start; // or length: see lookupUnit.
+    Elf::Off unit;
+};
+
+struct CachedFDE {
+    Elf::Addr iloc;
+    Elf::Off offset;
+};
+}
+
+/*
+ * The sections we build the address ranges from: the "aranges" come from
+ * .debug_aranges, and the "unitranges" from the units' DIEs.
+ */
+std::vector<Reader::csptr>
+Info::aRangeSources(const char *kind) const
+{
+    if (strcmp(kind, "aranges") == 0)
+        return { io, arangesh };
+    return { io, abbrev, rangesh };
+}
+
+/*
+ * Replace the address ranges with those from the index cache, if there.
+ */
+bool
+Info::loadARanges(const char *kind) const
+{
+    Elf::IndexCache::Index<CachedARange> index;
+    if (!Elf::IndexCache::load(*elf, kind, aRangeSources(kind), index))
+        return false;
+    size_t infoSize = io ? io->size() : 0;
+    for (auto &range : index)
+        if (range.unit >= infoSize)
+            return false;
+    aranges.ranges.clear();
+    for (auto &range : index)
+        aranges.ranges.emplace_hint(aranges.ranges.end(), range.end,
+                std::make_pair(range.start, range.unit));
+    return true;
+}
+
+void
+Info::storeARanges(const char *kind) const
+{
+    std::vector<CachedARange> ranges;
+    ranges.reserve(aranges.ranges.size());
+    for (auto &range : aranges.ranges)
+        ranges.push_back(CachedARange{ range.first, range.second.first, range.second.second });
+    Elf::IndexCache::store(*elf, kind, aRangeSources(kind), ranges.data(), ranges.size());
+}
+
 Unit::Unit(const Info *di, DWARFReader &r)
     : dwarf(di)
     , io(r.io)
@@ -418,7 +574,8 @@ Unit::offsetToRawDIE(const DIE &parent, Elf::Off offset) {
     auto &rawptr = allEntries[offset];
     if (rawptr == nullptr)
         rawptr = decodeEntry(parent, offset);
-    return rawptr;
+    // The DIE shares ownership of the arena, keeping it alive across purges.
+    return rawptr != nullptr ? std::shared_ptr<RawDIE>(arena, rawptr) : nullptr;
 }
 
 DIE
@@ -523,7 +680,17 @@ LineState::LineState(LineInfo *li)
 static void
 dwarfStateAddRow(LineInfo *li, const LineState &state)
 {
-    li->matrix.push_back(state);
+    LineRow row;
+    row.addr = state.addr;
+    row.line = state.line;
+    row.file = state.file - &li->files[0];
+    row.column = std::min(state.column, 2047U);
+    row.is_stmt = state.is_stmt;
+    row.basic_block = state.basic_block;
+    row.end_sequence = state.end_sequence;
+    row.prologue_end = state.prologue_end;
+    row.epilogue_begin = state.epilogue_begin;
+    li->matrix.push_back(row);
 }
 
 void
@@ -580,6 +747,7 @@ LineInfo::build(DWARFReader &r, const Unit *unit)
     }
 
     LineState state(this);
+    size_t sequenceStart = 0;
     while (r.getOffset() < end) {
         unsigned c = r.getu8();
         if (c >= opcode_base) {
@@ -600,6 +768,10 @@ LineInfo::build(DWARFReader &r, const Unit *unit)
             case DW_LNE_end_sequence:
                 state.end_sequence = true;
                 dwarfStateAddRow(this, state);
+                if (matrix.size() - 1 > sequenceStart)
+                    sequences.push_back(LineSequence{ matrix[sequenceStart].addr, state.addr,
+                            uint32_t(sequenceStart), uint32_t(matrix.size() - 1) });
+                sequenceStart = matrix.size();
                 state = LineState(this);
                 break;
             case DW_LNE_set_address:
@@ -666,6 +838,24 @@ LineInfo::build(DWARFReader &r, const Unit *unit)
             }
         }
     }
+    std::stable_sort(sequences.begin(), sequences.end(),
+            [] (const LineSequence &lhs, const LineSequence &rhs) { return lhs.low < rhs.low; });
+}
+
+const LineRow *
+LineInfo::findRow(Elf::Addr addr) const
+{
+    auto seq = std::upper_bound(sequences.begin(), sequences.end(), addr,
+            [] (Elf::Addr addr, const LineSequence &seq) { return addr < seq.low; });
+    if (seq == sequences.begin() || (--seq)->high <= addr)
+        return nullptr;
+    // The rows in a sequence are in address order: find the last one at or
+    // before addr. It can't be the end_sequence row, as that's at "high".
+    auto first = matrix.begin() + seq->first;
+    auto last = matrix.begin() + seq->last;
+    auto row = std::upper_bound(first, last, addr,
+            [] (Elf::Addr addr, const LineRow &row) { return addr < row.addr; });
+    return row == first ? nullptr : &*(row - 1);
 }
 
 FileEntry::FileEntry(string name_, string dir_, unsigned lastMod_, unsigned length_)
@@ -817,32 +1007,28 @@ RawDIE::readValue(DWARFReader &r, const FormEntry &forment, Value &value, Unit *
         break;
 
     case DW_FORM_block1:
-        value.block = new Block();
-        value.block->length = r.getu8();
-        value.block->offset = r.getOffset();
-        r.skip(value.block->length);
+        value.block.length = r.getu8();
+        value.block.offset = r.getOffset();
+        r.skip(value.block.length);
         break;
 
     case DW_FORM_block2:
-        value.block = new Block();
-        value.block->length = r.getu16();
-        value.block->offset = r.getOffset();
-        r.skip(value.block->length);
+        value.block.length = r.getu16();
+        value.block.offset = r.getOffset();
+        r.skip(value.block.length);
         break;
 
     case DW_FORM_block4:
-        value.block = new Block();
-        value.block->length = r.getu32();
-        value.block->offset = r.getOffset();
-        r.skip(value.block->length);
+        value.block.length = r.getu32();
+        value.block.offset = r.getOffset();
+        r.skip(value.block.length);
         break;
 
     case DW_FORM_exprloc:
     case DW_FORM_block:
-        value.block = new Block();
-        value.block->length = r.getuleb128();
-        value.block->offset = r.getOffset();
-        r.skip(value.block->length);
+        value.block.length = r.getuleb128();
+        value.block.offset = r.getOffset();
+        r.skip(value.block.length);
         break;
 
     case DW_FORM_flag:
@@ -872,26 +1058,6 @@ RawDIE::readValue(DWARFReader &r, const FormEntry &forment, Value &value, Unit *
     }
 }
 
-RawDIE::~RawDIE()
-{
-    stats.delone();
-    int i = 0;
-    for (auto &forment : type->forms) {
-        switch (forment.form) {
-            case DW_FORM_exprloc:
-            case DW_FORM_block:
-            case DW_FORM_block1:
-            case DW_FORM_block2:
-            case DW_FORM_block4:
-                delete values[i].block;
-                break;
-            default:
-                break;
-        }
-        ++i;
-    }
-}
-
 const LineInfo *
 Unit::getLines()
 {
@@ -916,13 +1082,14 @@ Unit::getLines()
     return lines.get();
 }
 
-RawDIE::RawDIE(Unit *unit, DWARFReader &r, size_t abbrev, Elf::Off parent_)
+RawDIE::RawDIE(Unit *unit, DIEArena &arena, DWARFReader &r, size_t abbrev, Elf::Off parent_)
     : type(unit->findAbbreviation(abbrev))
-    , values(type->forms.size())
+    , values(arena.alloc<Value>(type->forms.size()))
     , parent(parent_)
     , firstChild(0)
     , nextSibling(0)
 {
+    memset(values, 0, sizeof *values * type->forms.size());
     size_t i = 0;
     for (auto &form : type->forms) {
         readValue(r, form, values[i], unit);
@@ -937,6 +1104,7 @@ RawDIE::RawDIE(Unit *unit, DWARFReader &r, size_t abbrev, Elf::Off parent_)
         nextSibling = r.getOffset(); // we have no children, so next DIE is next sib
         firstChild = 0; // no children.
     }
+    arena.dieCount++;
     stats.addone();
 }
 
@@ -947,7 +1115,7 @@ Unit::findAbbreviation(size_t code) const
     return it != abbreviations.end() ? &it->second : nullptr;
 }
 
-std::shared_ptr<RawDIE>
+RawDIE *
 Unit::decodeEntry(const DIE &parent, Elf::Off offset)
 {
     DWARFReader r(io, offset);
@@ -959,7 +1127,9 @@ Unit::decodeEntry(const DIE &parent, Elf::Off offset)
             parent.raw->nextSibling = r.getOffset();
         return nullptr;
     }
-    return std::make_shared<RawDIE>(this, r, abbrev, parent.getOffset());
+    if (arena == nullptr)
+        arena = make_shared<DIEArena>();
+    return new (arena->alloc<RawDIE>()) RawDIE(this, *arena, r, abbrev, parent.getOffset());
 }
 
 void
@@ -969,6 +1139,7 @@ Unit::purge()
     {
         AllEntries destroy;
         std::swap(allEntries, destroy);
+        arena.reset();
     }
     auto end = stats.currentDIEs;
     if (verbose >= 3)
@@ -1071,7 +1242,7 @@ DWARFReader::getlength(size_t *addrLen)
 }
 
 Elf::Off
-CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff)
+CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff) const
 {
     size_t addrLen;
     Elf::Off length = r.getlength(&addrLen);
@@ -1087,19 +1258,244 @@ CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff)
 }
 
 bool
-CFI::isCIE(Elf::Addr cieid)
+CFI::isCIE(Elf::Addr cieid) const
 {
     return (type == FI_DEBUG_FRAME && cieid == 0xffffffff) || (type == FI_EH_FRAME && cieid == 0);
 }
 
-CFI::CFI(Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_)
+CFI::CFI(Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_,
+        const Elf::Section *hdr)
     : dwarf(info)
     , sectionAddr(addr)
     , io(std::move(io_))
     , type(type_)
 {
+    if (hdr != nullptr && parseSearchTable(*hdr))
+        return;
+    Elf::IndexCache::Index<CachedFDE> index;
+    auto valid = [this] (const CachedFDE &fde) { return fde.offset < Elf::Off(io->size()); };
+    if (Elf::IndexCache::load(*dwarf->elf, cacheKind(), { io }, index)
+            && std::all_of(index.begin(), index.end(), valid)) {
+        searchTable.reserve(index.count);
+        for (auto &fde : index)
+            searchTable.emplace_back(fde.iloc, fde.offset);
+        return;
+    }
+    decodeFDEs();
+}
+
+const char *
+CFI::cacheKind() const
+{
+    return type == FI_EH_FRAME ? "eh_frame" : "debug_frame";
+}
+
+/*
+ * Decode a value from .eh_frame_hdr - its pcrel and datarel encodings are
+ * relative to the address of the .eh_frame_hdr section itself.
+ */
+static Elf::Addr
+decodeHdrValue(DWARFReader &r, int encoding, Elf::Addr hdrAddr)
+{
+    Elf::Off offset = r.getOffset();
+    Elf::Addr value;
+    switch (encoding & 0xf) {
+        case DW_EH_PE_absptr: value = r.getuint(sizeof (Elf::Addr)); break;
+        case DW_EH_PE_udata2: value = r.getuint(2); break;
+        case DW_EH_PE_udata4: value = r.getuint(4); break;
+        case DW_EH_PE_udata8: value = r.getuint(8); break;
+        case DW_EH_PE_sdata2: value = r.getint(2); break;
+        case DW_EH_PE_sdata4: value = r.getint(4); break;
+        case DW_EH_PE_sdata8: value = r.getint(8); break;
+        case DW_EH_PE_uleb128: value = r.getuleb128(); break;
+        case DW_EH_PE_sleb128: value = r.getsleb128(); break;
+        default:
+            throw (Exception() << "unsupported .eh_frame_hdr encoding " << encoding);
+    }
+    switch (encoding & 0x70) {
+        case 0: break;
+        case DW_EH_PE_pcrel: value += hdrAddr + offset; break;
+        case DW_EH_PE_datarel: value += hdrAddr; break;
+        default:
+            throw (Exception() << "unsupported .eh_frame_hdr encoding " << encoding);
+    }
+    return value;
+}
+
+/*
+ * Read the binary search table from .eh_frame_hdr. Returns false if there's
+ * no table we can use, in which case we fall back to decoding the entire
+ * .eh_frame section.
+ */
+bool
+CFI::parseSearchTable(const Elf::Section &hdr)
+{
+    try {
+        DWARFReader r(hdr.io);
+        auto version = r.getu8();
+        auto ehFramePtrEnc = r.getu8();
+        auto fdeCountEnc = r.getu8();
+        auto tableEnc = r.getu8();
+        if (version != 1 || fdeCountEnc == DW_EH_PE_omit || tableEnc == DW_EH_PE_omit)
+            return false;
+        // Linkers always generate a table of datarel, sdata4 pairs: we can
+        // read that in one go. Don't bother with anything else.
+        if (tableEnc != (DW_EH_PE_datarel | DW_EH_PE_sdata4))
+            return false;
+        auto hdrAddr = hdr.shdr.sh_addr;
+        decodeHdrValue(r, ehFramePtrEnc, hdrAddr);
+        size_t count = decodeHdrValue(r, fdeCountEnc, hdrAddr);
+        std::vector<int32_t> table(count * 2);
+        hdr.io->readObj(r.getOffset(), table.data(), table.size());
+        searchTable.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+            searchTable.emplace_back(hdrAddr + table[i * 2],
+                    hdrAddr + table[i * 2 + 1] - sectionAddr);
+        if (verbose >= 2)
+            *debug << "using " << count << " entry search table from .eh_frame_hdr for "
+                << *io << "\n";
+        return true;
+    }
+    catch (const Exception &ex) {
+        if (verbose > 0)
+            *debug << "can't use .eh_frame_hdr for " << *io << ": " << ex.what() << "\n";
+        searchTable.clear();
+        return false;
+    }
+}
+
+void
+CFI::ensureCIE(Elf::Off offset) const
+{
+    if (cies.find(offset) != cies.end())
+        return;
+    DWARFReader reader(io, offset);
+    Elf::Off associatedCIE;
+    auto end = decodeCIEFDEHdr(reader, type, &associatedCIE);
+    cies.emplace(std::piecewise_construct,
+                std::forward_as_tuple(offset),
+                std::forward_as_tuple(this, reader, end));
+}
+
+const CIE *
+CFI::getCIE(Elf::Off offset) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = cies.find(offset);
+    return it != cies.end() ? &it->second : nullptr;
+}
+
+const CFIExpression &
+CFI::expression(const Block &block) const
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = expressions.find(block.offset);
+        if (it != expressions.end())
+            return it->second;
+    }
+
+    // Compile without the lock: a racing thread will produce the same result.
+    CFIExpression expr;
+    expr.compiled = true;
+    DWARFReader r(io, block.offset, block.offset + block.length);
+    while (expr.compiled && !r.empty()) {
+        auto op = ExpressionOp(r.getu8());
+        CFIExpression::Op cop { uint8_t(op), 0, 0 };
+        switch (op) {
+            case DW_OP_lit0: case DW_OP_lit1: case DW_OP_lit2: case DW_OP_lit3: case DW_OP_lit4:
+            case DW_OP_lit5: case DW_OP_lit6: case DW_OP_lit7: case DW_OP_lit8: case DW_OP_lit9:
+            case DW_OP_lit10: case DW_OP_lit11: case DW_OP_lit12: case DW_OP_lit13: case DW_OP_lit14:
+            case DW_OP_lit15: case DW_OP_lit16: case DW_OP_lit17: case DW_OP_lit18: case DW_OP_lit19:
+            case DW_OP_lit20: case DW_OP_lit21: case DW_OP_lit22: case DW_OP_lit23: case DW_OP_lit24:
+            case DW_OP_lit25: case DW_OP_lit26: case DW_OP_lit27: case DW_OP_lit28: case DW_OP_lit29:
+            case DW_OP_lit30: case DW_OP_lit31:
+                cop.op = DW_OP_constu;
+                cop.operand = op - DW_OP_lit0;
+                break;
+            case DW_OP_const1u:
+                cop.op = DW_OP_constu;
+                cop.operand = r.getu8();
+                break;
+            case DW_OP_const2s:
+                cop.op = DW_OP_constu;
+                cop.operand = int16_t(r.getu16());
+                break;
+            case DW_OP_const4u:
+                cop.op = DW_OP_constu;
+                cop.operand = r.getu32();
+                break;
+            case DW_OP_const4s:
+                cop.op = DW_OP_constu;
+                cop.operand = int32_t(r.getu32());
+                break;
+            case DW_OP_constu:
+                cop.operand = r.getuleb128();
+                break;
+            case DW_OP_consts:
+                cop.op = DW_OP_constu;
+                cop.operand = r.getsleb128();
+                break;
+            case DW_OP_plus_uconst:
+                cop.operand = r.getuleb128();
+                break;
+            case DW_OP_addr:
+                cop.operand = r.getuint(r.addrLen);
+                break;
+
+            case DW_OP_breg0: case DW_OP_breg1: case DW_OP_breg2: case DW_OP_breg3:
+            case DW_OP_breg4: case DW_OP_breg5: case DW_OP_breg6: case DW_OP_breg7:
+            case DW_OP_breg8: case DW_OP_breg9: case DW_OP_breg10: case DW_OP_breg11:
+            case DW_OP_breg12: case DW_OP_breg13: case DW_OP_breg14: case DW_OP_breg15:
+            case DW_OP_breg16: case DW_OP_breg17: case DW_OP_breg18: case DW_OP_breg19:
+            case DW_OP_breg20: case DW_OP_breg21: case DW_OP_breg22: case DW_OP_breg23:
+            case DW_OP_breg24: case DW_OP_breg25: case DW_OP_breg26: case DW_OP_breg27:
+            case DW_OP_breg28: case DW_OP_breg29: case DW_OP_breg30: case DW_OP_breg31:
+                cop.op = DW_OP_bregx;
+                cop.reg = op - DW_OP_breg0;
+                cop.operand = r.getsleb128();
+                break;
+            case DW_OP_bregx:
+                cop.reg = r.getuleb128();
+                cop.operand = r.getsleb128();
+                break;
+
+            case DW_OP_deref: case DW_OP_dup: case DW_OP_drop:
+            case DW_OP_plus: case DW_OP_minus: case DW_OP_and: case DW_OP_or:
+            case DW_OP_shl: case DW_OP_shr:
+            case DW_OP_le: case DW_OP_ge: case DW_OP_eq:
+            case DW_OP_lt: case DW_OP_gt: case DW_OP_ne:
+            case DW_OP_call_frame_cfa:
+                break;
+
+            default:
+                expr.compiled = false;
+                break;
+        }
+        expr.ops.push_back(cop);
+    }
+    if (!expr.compiled)
+        expr.ops.clear();
+
+    std::lock_guard<std::mutex> guard(lock);
+    return expressions.emplace(block.offset, std::move(expr)).first->second;
+}
+
+const std::vector<FDE> &
+CFI::getFDEs() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return decodeFDEs();
+}
+
+const std::vector<FDE> &
+CFI::decodeFDEs() const
+{
+    if (fdeListDecoded)
+        return fdeList;
+    fdeListDecoded = true;
     DWARFReader reader(io);
-    // decode in 2 passes: first for CIE, then for FDE
+    std::vector<CachedFDE> index;
     Elf::Off nextoff;
     for (; !reader.empty();  reader.setOffset(nextoff)) {
         size_t startOffset = reader.getOffset();
@@ -1107,32 +1503,67 @@ CFI::CFI(Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_)
         nextoff = decodeCIEFDEHdr(reader, type, &associatedCIE);
         if (nextoff == 0)
             break;
-        auto ensureCIE = [this, &reader, nextoff] (Elf::Off offset) {
-            // This is in fact a CIE - add it in if we have not seen it yet.
-            if (cies.find(offset) != cies.end())
-                return;
-            cies.emplace(std::piecewise_construct,
-                        std::forward_as_tuple(offset),
-                        std::forward_as_tuple(this, reader, nextoff));
-        };
         if (associatedCIE == Elf::Off(-1)) {
             ensureCIE(startOffset);
         } else {
             // Make sure we have the associated CIE.
             ensureCIE(associatedCIE);
             fdeList.emplace_back(this, reader, associatedCIE, nextoff);
+            index.push_back(CachedFDE{ fdeList.back().iloc, startOffset });
         }
     }
+    std::sort(fdeList.begin(), fdeList.end(),
+            [] (const FDE &lhs, const FDE &rhs) { return lhs.iloc < rhs.iloc; });
+    // If we've no search table, save one in the index cache for next time.
+    if (searchTable.empty()) {
+        std::sort(index.begin(), index.end(),
+                [] (const CachedFDE &lhs, const CachedFDE &rhs) { return lhs.iloc < rhs.iloc; });
+        Elf::IndexCache::store(*dwarf->elf, cacheKind(), { io }, index.data(), index.size());
+    }
+    return fdeList;
+}
+
+const FDE *
+CFI::decodeFDE(Elf::Off offset) const
+{
+    auto it = fdesByOffset.find(offset);
+    if (it != fdesByOffset.end())
+        return &it->second;
+    DWARFReader reader(io, offset);
+    Elf::Off associatedCIE;
+    auto nextoff = decodeCIEFDEHdr(reader, type, &associatedCIE);
+    if (nextoff == 0 || associatedCIE == Elf::Off(-1))
+        return nullptr;
+    ensureCIE(associatedCIE);
+    return &fdesByOffset.emplace(std::piecewise_construct,
+            std::forward_as_tuple(offset),
+            std::forward_as_tuple(this, reader, associatedCIE, nextoff)).first->second;
 }
 
 const FDE *
 CFI::findFDE(Elf::Addr addr) const
 {
-    for (const auto &fde : fdeList) {
-        if (fde.iloc <= addr && fde.iloc + fde.irange > addr)
-            return &fde;
+    // Find the last FDE starting at or before addr: FDEs don't overlap, so
+    // that's the only one that can contain it.
+    std::lock_guard<std::mutex> guard(lock);
+    if (!searchTable.empty()) {
+        auto it = std::upper_bound(searchTable.begin(), searchTable.end(), addr,
+                [] (Elf::Addr addr, const std::pair<Elf::Addr, Elf::Off> &ent)
+                { return addr < ent.first; });
+        if (it == searchTable.begin())
+            return nullptr;
+        --it;
+        auto fde = decodeFDE(it->second);
+        return fde != nullptr && fde->iloc <= addr && fde->iloc + fde->irange > addr
+            ? fde : nullptr;
     }
-    return nullptr;
+    const auto &fdes = decodeFDEs();
+    auto it = std::upper_bound(fdes.begin(), fdes.end(), addr,
+            [] (Elf::Addr addr, const FDE &fde) { return addr < fde.iloc; });
+    if (it == fdes.begin())
+        return nullptr;
+    --it;
+    return it->iloc + it->irange > addr ? &*it : nullptr;
 }
 
 bool
@@ -1143,14 +1574,10 @@ sourceFromAddrInUnit(const Unit::sptr &unit, Elf::Addr addr,
         return false;
     auto lines = unit->getLines();
     if (lines) {
-        for (auto i = lines->matrix.begin(); i != lines->matrix.end(); ++i) {
-            if (i->end_sequence)
-                continue;
-            auto next = i+1;
-            if (i->addr <= addr && next->addr > addr) {
-                info.emplace_back(i->file->name, i->line);
-                return true;
-            }
+        auto row = lines->findRow(addr);
+        if (row != nullptr) {
+            info.emplace_back(lines->files[row->file].name, row->line);
+            return true;
         }
     }
     return false;
@@ -1189,11 +1616,8 @@ CallFrame::CallFrame()
     : cfaReg(0)
     , cfaValue{ .type = UNDEF, .u = { .arch = 0  } }
 {
-    cfaReg = 0;
-    cfaValue.type = UNDEF;
-#define REGMAP(number, field) registers[number].type = UNDEF;
-#include "libpstack/dwarf/archreg.h"
-#undef REGMAP
+    for (auto &reg : registers)
+        reg = RegisterUnwind { .type = UNDEF, .u = { .arch = 0 } };
 #ifdef CFA_RESTORE_REGNO
     registers[CFA_RESTORE_REGNO].type = ARCH;
 #endif
@@ -1208,6 +1632,12 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
     uintmax_t offset;
     int reg, reg2;
 
+    // Rules for registers the architecture doesn't define are discarded.
+    RegisterUnwind ignored;
+    auto rule = [&frame, &ignored](int regno) -> RegisterUnwind & {
+        return unsigned(regno) < MAX_DWARF_REGS ? frame.registers[regno] : ignored;
+    };
+
     // default frame for this CIE.
     CallFrame dframe;
     if (addr != 0 || wantAddr != 0) {
@@ -1228,12 +1658,13 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
 
         case DW_CFA_offset:
             offset = r.getuleb128();
-            frame.registers[reg].type = OFFSET;
-            frame.registers[reg].u.offset = offset * dataAlign;
+            rule(reg).type = OFFSET;
+            rule(reg).u.offset = offset * dataAlign;
             break;
 
         case DW_CFA_restore: {
-            frame.registers[reg] = dframe.registers[reg];
+            if (unsigned(reg) < MAX_DWARF_REGS)
+                frame.registers[reg] = dframe.registers[reg];
             break;
         }
 
@@ -1262,30 +1693,31 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
             case DW_CFA_offset_extended:
                 reg = r.getuleb128();
                 offset = r.getuleb128();
-                frame.registers[reg].type = OFFSET;
-                frame.registers[reg].u.offset = offset * dataAlign;
+                rule(reg).type = OFFSET;
+                rule(reg).u.offset = offset * dataAlign;
                 break;
 
             case DW_CFA_restore_extended:
                 reg = r.getuleb128();
-                frame.registers[reg] = dframe.registers[reg];
+                if (unsigned(reg) < MAX_DWARF_REGS)
+                    frame.registers[reg] = dframe.registers[reg];
                 break;
 
             case DW_CFA_undefined:
                 reg = r.getuleb128();
-                frame.registers[reg].type = UNDEF;
+                rule(reg).type = UNDEF;
                 break;
 
             case DW_CFA_same_value:
                 reg = r.getuleb128();
-                frame.registers[reg].type = SAME;
+                rule(reg).type = SAME;
                 break;
 
             case DW_CFA_register:
                 reg = r.getuleb128();
                 reg2 = r.getuleb128();
-                frame.registers[reg].type = REG;
-                frame.registers[reg].u.reg = reg2;
+                rule(reg).type = REG;
+                rule(reg).u.reg = reg2;
                 break;
 
             case DW_CFA_remember_state:
@@ -1326,7 +1758,7 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
 
             case DW_CFA_val_expression: {
                 reg = r.getuleb128();
-                auto &unwind = frame.registers[reg];
+                auto &unwind = rule(reg);
                 unwind.type = VAL_EXPRESSION;
                 unwind.u.expression.length = r.getuleb128();
                 unwind.u.expression.offset = r.getOffset();
@@ -1337,7 +1769,7 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
             case DW_CFA_expression: {
                 reg = r.getuleb128();
                 offset = r.getuleb128();
-                auto &unwind = frame.registers[reg];
+                auto &unwind = rule(reg);
                 unwind.type = EXPRESSION;
                 unwind.u.expression.offset = r.getOffset();
                 unwind.u.expression.length = offset;
@@ -1376,7 +1808,7 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
     return frame;
 }
 
-FDE::FDE(CFI *fi, DWARFReader &reader, Elf::Off cieOff_, Elf::Off endOff_)
+FDE::FDE(const CFI *fi, DWARFReader &reader, Elf::Off cieOff_, Elf::Off endOff_)
     : end(endOff_)
     , cieOff(cieOff_)
 {
@@ -1596,6 +2028,137 @@ DIE::containsAddress(Elf::Addr addr) const
     return rc;
 }
 
+/*
+ * Get the address ranges for a DIE, as used by containsAddress. Returns false
+ * if the DIE has no address information we can use.
+ */
+static bool
+dieRanges(const DIE &die, Ranges &out)
+{
+    auto low = die.attribute(DW_AT_low_pc, true);
+    auto high = die.attribute(DW_AT_high_pc, true);
+    if (low.valid() && high.valid()) {
+        if (low.form() != DW_FORM_addr)
+            return false;
+        Elf::Addr start = uintmax_t(low);
+        switch (high.form()) {
+            case DW_FORM_addr:
+                out.emplace_back(start, uintmax_t(high));
+                return true;
+            case DW_FORM_data1:
+            case DW_FORM_data2:
+            case DW_FORM_data4:
+            case DW_FORM_data8:
+            case DW_FORM_udata:
+                out.emplace_back(start, start + uintmax_t(high));
+                return true;
+            default:
+                return false;
+        }
+    }
+    const auto &dwarf = die.getUnit()->dwarf;
+    if (!dwarf->hasRanges())
+        return false;
+    auto ranges = die.attribute(DW_AT_ranges, true);
+    if (!ranges.valid())
+        return false;
+    Elf::Addr base = low.valid() ? uintmax_t(low) : 0;
+    for (auto &range : dwarf->rangesAt(uintmax_t(ranges)))
+        out.emplace_back(range.first + base, range.second + base);
+    return true;
+}
+
+UnitAddrIndex::UnitAddrIndex(const Unit::sptr &unit)
+{
+    struct Piece {
+        Elf::Addr low;
+        Elf::Addr high;
+        int entry;
+        int depth;
+    };
+    std::vector<Piece> pieces;
+
+    // Walk the DIE tree, recording the ranges of each function, and linking
+    // each to its closest enclosing function.
+    std::function<void(const DIE &, int, int)> walk = [&] (const DIE &die, int parent, int depth) {
+        auto tag = die.tag();
+        if (tag == DW_TAG_subprogram || tag == DW_TAG_inlined_subroutine) {
+            Ranges ranges;
+            if (dieRanges(die, ranges) && !ranges.empty()) {
+                entries.push_back(Entry{ die.getOffset(), tag, parent });
+                parent = int(entries.size() - 1);
+                depth++;
+                for (auto &range : ranges)
+                    if (range.first < range.second)
+                        pieces.push_back(Piece{ range.first, range.second, parent, depth });
+            }
+        }
+        if (die.hasChildren())
+            for (auto child : die.children())
+                walk(child, parent, depth);
+    };
+    walk(unit->root(), -1, 0);
+
+    // Split the address space at each boundary, and assign each resulting
+    // segment to the deepest entry that covers it.
+    std::vector<Elf::Addr> bounds;
+    bounds.reserve(pieces.size() * 2);
+    for (auto &piece : pieces) {
+        bounds.push_back(piece.low);
+        bounds.push_back(piece.high);
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    std::stable_sort(pieces.begin(), pieces.end(),
+            [] (const Piece &lhs, const Piece &rhs) { return lhs.depth < rhs.depth; });
+    std::vector<int> owners(bounds.size(), -1);
+    for (auto &piece : pieces) {
+        for (auto i = std::lower_bound(bounds.begin(), bounds.end(), piece.low) - bounds.begin();
+                bounds[i] < piece.high; ++i)
+            owners[i] = piece.entry;
+    }
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        if (owners[i] == -1)
+            continue;
+        if (!ranges.empty() && ranges.back().high == bounds[i] && ranges.back().entry == owners[i])
+            ranges.back().high = bounds[i + 1];
+        else
+            ranges.push_back(Range{ bounds[i], bounds[i + 1], owners[i] });
+    }
+    if (verbose >= 3)
+        *debug << "indexed " << entries.size() << " functions in " << ranges.size()
+            << " ranges for unit " << unit->name() << "\n";
+}
+
+std::vector<DIE>
+Info::functionsForAddr(Elf::Addr addr) const
+{
+    std::vector<DIE> functions;
+    auto unit = lookupUnit(addr);
+    if (!unit)
+        return functions;
+    auto &index = addrIndices[unit->offset];
+    if (index == nullptr)
+        index = make_unique<UnitAddrIndex>(unit);
+
+    auto it = std::upper_bound(index->ranges.begin(), index->ranges.end(), addr,
+            [] (Elf::Addr addr, const UnitAddrIndex::Range &range) { return addr < range.low; });
+    if (it == index->ranges.begin() || (--it)->high <= addr)
+        return functions;
+
+    // The chain of enclosing entries, innermost first. The outermost must be
+    // the subprogram itself - only report the inlined subroutines inside it.
+    std::vector<const UnitAddrIndex::Entry *> chain;
+    for (int i = it->entry; i != -1; i = index->entries[i].parent)
+        chain.push_back(&index->entries[i]);
+    if (chain.back()->tag != DW_TAG_subprogram)
+        return functions;
+    for (auto entry = chain.rbegin(); entry != chain.rend(); ++entry)
+        if (entry == chain.rbegin() || (*entry)->tag == DW_TAG_inlined_subroutine)
+            functions.push_back(unit->offsetToDIE((*entry)->offset));
+    return functions;
+}
+
 Attribute
 DIE::attribute(AttrName name, bool local) const
 {
@@ -1630,15 +2193,12 @@ ImageCache::getDwarf(const string &filename)
 Info::sptr
 ImageCache::getDwarf(Elf::Object::sptr object)
 {
-    auto it = dwarfCache.find(object);
+    bool hit;
     dwarfLookups++;
-    if (it != dwarfCache.end()) {
+    auto dwarf = dwarfCache.get(object, [this, &object] {
+        return make_shared<Info>(object, *this); }, &hit);
+    if (hit)
         dwarfHits++;
-        return it->second;
-    }
-
-    auto dwarf = make_shared<Info>(object, *this);
-    dwarfCache[object] = dwarf;
     return dwarf;
 }
 
@@ -1648,8 +2208,8 @@ ImageCache::ImageCache() : dwarfHits(0), dwarfLookups(0)
 
 ImageCache::~ImageCache() {
     if (verbose >= 2)
-        *debug << "DWARF image cache: lookups: " << dwarfLookups << ", hits="
-            << dwarfHits << std::endl;
+        *debug << "DWARF image cache: lookups: " << dwarfLookups.load() << ", hits="
+            << dwarfHits.load() << std::endl;
 }
 
 void
@@ -1752,7 +2312,7 @@ DIEAttributes::end() const {
 }
 
 const Value &Attribute::value() const {
-    return dieref.raw->values.at(formp - &dieref.raw->type->forms[0]);
+    return dieref.raw->values[formp - &dieref.raw->type->forms[0]];
 }
 
 Tag DIE::tag() const {
@@ -7,6 +7,14 @@
 #include <stack>
 
 namespace Dwarf {
+
+// The DWARF register numbers for the architecture's registers, in order.
+static const int archRegisters[] = {
+#define REGMAP(number, field) number,
+#include "libpstack/dwarf/archreg.h"
+#undef REGMAP
+};
+
 void
 StackFrame::setCoreRegs(const Elf::CoreRegisters &sys)
 {
@@ -321,19 +329,108 @@ StackFrame::getCFA(const Process &proc, const CallFrame &dcf) const
 
         case OFFSET:
             return getReg(dcf.cfaReg) + dcf.cfaValue.u.offset;
-        case EXPRESSION: {
-            ExpressionStack stack;
-            auto start = dcf.cfaValue.u.expression.offset;
-            auto end = start + dcf.cfaValue.u.expression.length;
-            DWARFReader r(frameInfo->io, start, end);
-            return stack.eval(proc, r, this, elfReloc);
-        }
+        case EXPRESSION:
+            return evalCFIExpression(proc, dcf.cfaValue.u.expression, false);
     }
     return -1;
 }
 
-StackFrame *
-StackFrame::unwind(Process &p)
+/*
+ * Evaluate an expression from this frame's CFI, using its compiled form if
+ * possible. Expressions for register rules start with the CFA on the stack.
+ */
+Elf::Addr
+StackFrame::evalCFIExpression(const Process &proc, const Block &block, bool pushCFA) const
+{
+    const auto &expr = frameInfo->expression(block);
+    if (!expr.compiled) {
+        ExpressionStack stack;
+        if (pushCFA)
+            stack.push(cfa);
+        DWARFReader r(frameInfo->io, block.offset, block.offset + block.length);
+        return stack.eval(proc, r, this, elfReloc);
+    }
+
+    // CFI expressions are short: a small fixed stack is plenty.
+    Elf::Addr stack[32];
+    size_t depth = 0;
+    auto push = [&stack, &depth] (Elf::Addr value) {
+        if (depth == sizeof stack / sizeof stack[0])
+            throw (Exception() << "DWARF expression stack overflow");
+        stack[depth++] = value;
+    };
+    auto pop = [&stack, &depth] () {
+        if (depth == 0)
+            throw (Exception() << "DWARF expression stack underflow");
+        return stack[--depth];
+    };
+
+    if (pushCFA)
+        push(cfa);
+    for (const auto &op : expr.ops) {
+        switch (ExpressionOp(op.op)) {
+            case DW_OP_constu:
+                push(op.operand);
+                break;
+            case DW_OP_addr:
+                push(op.operand + elfReloc);
+                break;
+            case DW_OP_bregx:
+                push(getReg(op.reg) + op.operand);
+                break;
+            case DW_OP_call_frame_cfa:
+                push(cfa);
+                break;
+            case DW_OP_plus_uconst:
+                push(pop() + op.operand);
+                break;
+            case DW_OP_deref: {
+                Elf::Addr value;
+                proc.io->readObj(pop(), &value);
+                push(value);
+                break;
+            }
+            case DW_OP_dup: {
+                Elf::Addr tos = pop();
+                push(tos);
+                push(tos);
+                break;
+            }
+            case DW_OP_drop:
+                pop();
+                break;
+            default: {
+                // binary operators.
+                Elf::Addr rhs = pop();
+                Elf::Addr lhs = pop();
+                switch (ExpressionOp(op.op)) {
+                    case DW_OP_plus: push(lhs + rhs); break;
+                    case DW_OP_minus: push(lhs - rhs); break;
+                    case DW_OP_and: push(lhs & rhs); break;
+                    case DW_OP_or: push(lhs | rhs); break;
+                    case DW_OP_shl: push(lhs << rhs); break;
+                    case DW_OP_shr: push(lhs >> rhs); break;
+                    case DW_OP_le: push(lhs <= rhs); break;
+                    case DW_OP_ge: push(lhs >= rhs); break;
+                    case DW_OP_eq: push(lhs == rhs); break;
+                    case DW_OP_lt: push(lhs < rhs); break;
+                    case DW_OP_gt: push(lhs > rhs); break;
+                    case DW_OP_ne: push(lhs != rhs); break;
+                    default: abort(); // not compiled.
+                }
+                break;
+            }
+        }
+    }
+    return pop();
+}
+
+/*
+ * Find the object and CFI details for this frame, and fill in "out" with the
+ * registers of its caller. Returns false if the caller can't be found.
+ */
+bool
+StackFrame::unwind(Process &p, StackFrame &out)
 {
     std::tie(elfReloc, elf, phdr) = p.findSegment(scopeIP());
     if (elf == nullptr)
@@ -352,7 +449,7 @@ StackFrame::unwind(Process &p)
                 fde = f->findFDE(objaddr);
                 if (fde != nullptr) {
                     frameInfo = f;
-                    cie = &f->cies[fde->cieOff];
+                    cie = f->getCIE(fde->cieOff);
                     break;
                 }
             }
@@ -364,51 +461,69 @@ StackFrame::unwind(Process &p)
 
     DWARFReader r(frameInfo->io, fde->instructions, fde->end);
 
-    auto iter = dwarf->callFrameForAddr.find(objaddr);
-    if (iter == dwarf->callFrameForAddr.end())
-        dwarf->callFrameForAddr[objaddr] = cie->execInsns(r, fde->iloc, objaddr);
-
-    const CallFrame &dcf = dwarf->callFrameForAddr[objaddr];
+    const CallFrame *cachedFrame;
+    {
+        std::lock_guard<std::mutex> guard(dwarf->callFrameLock);
+        auto iter = dwarf->callFrameForAddr.find(objaddr);
+        cachedFrame = iter == dwarf->callFrameForAddr.end() ? nullptr : &iter->second;
+    }
+    if (cachedFrame == nullptr) {
+        // Run the CFA program without the lock: we may race with another
+        // thread to cache the same frame, but the results are identical.
+        auto frame = cie->execInsns(r, fde->iloc, objaddr);
+        std::lock_guard<std::mutex> guard(dwarf->callFrameLock);
+        cachedFrame = &dwarf->callFrameForAddr.emplace(objaddr, std::move(frame)).first->second;
+    }
+    const CallFrame &dcf = *cachedFrame;
 
     // Given the registers available, and the state of the call unwind data,
     // calculate the CFA at this point.
     cfa = getCFA(p, dcf);
-    auto rarInfo = dcf.registers.find(cie->rar);
+    const RegisterUnwind *rarInfo = unsigned(cie->rar) < MAX_DWARF_REGS ? &dcf.registers[cie->rar] : nullptr;
+
+    // Read the registers saved at offsets from the CFA in one batch.
+    std::vector<Elf::Addr> saved;
+    std::vector<Reader::Request> savedReads;
+    for (int regno : archRegisters)
+        if (dcf.registers[regno].type == OFFSET)
+            savedReads.push_back(Reader::Request { off_t(cfa + dcf.registers[regno].u.offset),
+                    sizeof (Elf::Addr), nullptr, 0 }); // XXX: assume addrLen = sizeof Elf_Addr
+    saved.resize(savedReads.size());
+    for (size_t i = 0; i < saved.size(); ++i)
+        savedReads[i].ptr = (char *)&saved[i];
+    if (!savedReads.empty())
+        p.io->readBatch(savedReads.data(), savedReads.size());
+    for (const auto &req : savedReads)
+        if (req.result != req.count)
+            throw (Exception() << "incomplete object read from " << *p.io
+                << " at offset " << req.offset << " for " << req.count << " bytes");
+    size_t savedIdx = 0;
 
-    auto out = new StackFrame(UnwindMechanism::DWARF);
 #ifdef CFA_RESTORE_REGNO
     // "The CFA is defined to be the stack pointer in the calling frame."
-    out->setReg(CFA_RESTORE_REGNO, cfa);
+    out.setReg(CFA_RESTORE_REGNO, cfa);
 #endif
-    for (auto &entry : dcf.registers) {
-        const auto &unwind = entry.second;
-        const int regno = entry.first;
+    for (int regno : archRegisters) {
+        const auto &unwind = dcf.registers[regno];
         switch (unwind.type) {
             case UNDEF:
             case SAME:
-                out->setReg(regno, getReg(regno));
+                out.setReg(regno, getReg(regno));
                 break;
-            case OFFSET: {
-                Elf::Addr reg; // XXX: assume addrLen = sizeof Elf_Addr
-                p.io->readObj(cfa + unwind.u.offset, &reg);
-                out->setReg(regno, reg);
+            case OFFSET:
+                out.setReg(regno, saved[savedIdx++]);
                 break;
-            }
             case REG:
-                out->setReg(regno, getReg(unwind.u.reg));
+                out.setReg(regno, getReg(unwind.u.reg));
                 break;
 
             case VAL_EXPRESSION:
             case EXPRESSION: {
-                ExpressionStack stack;
-                stack.push(cfa);
-                DWARFReader reader(frameInfo->io, unwind.u.expression.offset,
-                      unwind.u.expression.offset + unwind.u.expression.length);
-                auto val = stack.eval(p, reader, this, elfReloc);
+                auto val = evalCFIExpression(p, unwind.u.expression, true);
                 // EXPRESSIONs give an address, VAL_EXPRESSION gives a literal.
                 if (unwind.type == EXPRESSION)
                     p.io->readObj(val, &val);
-                out->setReg(regno, val);
+                out.setReg(regno, val);
                 break;
             }
 
@@ -419,30 +534,32 @@ StackFrame::unwind(Process &p)
     }
 
     // If the return address isn't defined, then we can't unwind.
-    if (rarInfo == dcf.registers.end() || rarInfo->second.type == UNDEF) {
+    if (rarInfo == nullptr || rarInfo->type == UNDEF) {
         if (verbose > 1) {
            *debug << "DWARF unwinding stopped at "
               << std::hex << scopeIP() << std::dec
-              << ": " << (rarInfo == dcf.registers.end() ?
+              << ": " << (rarInfo == nullptr ?
                     "no RAR register found" : "RAR register undefined")
               << std::endl;
         }
-        delete out;
-        return nullptr;
+        return false;
     }
-    return out;
+    return true;
 }
 
 void
 StackFrame::setReg(unsigned regno, cpureg_t regval)
 {
-    regs[regno] = regval;
+    // Registers the architecture doesn't define are never read back.
+    if (regno < MAX_DWARF_REGS) {
+        regs[regno] = regval;
+        regValid.set(regno);
+    }
 }
 
 cpureg_t
 StackFrame::getReg(unsigned regno) const
 {
-    auto i = regs.find(regno);
-    return i != regs.end() ? i->second : 0;
+    return regno < MAX_DWARF_REGS && regValid.test(regno) ? regs[regno] : 0;
 }
 }
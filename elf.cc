@@ -1,4 +1,5 @@
 #include "libpstack/elf.h"
+#include "libpstack/indexcache.h"
 #ifdef WITH_ZLIB
 #include "libpstack/inflatereader.h"
 #endif
@@ -288,10 +289,9 @@ Object::Object(ImageCache &cache, Reader::csptr io_)
 const Phdr *
 Object::getSegmentForAddress(Off a) const
 {
-    if (lastSegmentForAddress != nullptr &&
-          lastSegmentForAddress->p_vaddr <= a &&
-          lastSegmentForAddress->p_vaddr + lastSegmentForAddress->p_memsz > a)
-       return lastSegmentForAddress;
+    const Phdr *last = lastSegmentForAddress;
+    if (last != nullptr && last->p_vaddr <= a && last->p_vaddr + last->p_memsz > a)
+       return last;
     const auto &hdrs = getSegments(PT_LOAD);
 
     auto pos = std::lower_bound(hdrs.begin(), hdrs.end(), a,
@@ -323,47 +323,116 @@ Object::getInterpreter() const
     return "";
 }
 
+const Object::SymbolIndex &
+Object::getSymbolIndex(int type)
+{
+    auto it = symbolIndices.find(type);
+    if (it != symbolIndices.end())
+        return it->second;
+    auto &index = symbolIndices[type];
+    auto kind = stringify("symbols.", type);
+
+    // The index refers to symbols by their position in these tables, which
+    // might be in our debug object, so they're the sources of the cached one.
+    const Reader::csptr tables[] = {
+        commonSections->debugSymbols.symbols,
+        commonSections->dynamicSymbols.symbols
+    };
+    const IndexCache::Sources sources(std::begin(tables), std::end(tables));
+    auto valid = [&tables] (const AddrSymbol &sym) {
+        return sym.table < 2 && tables[sym.table]
+            && sym.index < tables[sym.table]->size() / sizeof (Sym);
+    };
+    IndexCache::Index<AddrSymbol> cached;
+    if (IndexCache::load(*this, kind.c_str(), sources, cached)
+            && std::all_of(cached.begin(), cached.end(), valid)) {
+        index.symbols.assign(cached.begin(), cached.end());
+    } else {
+        for (uint32_t table = 0; table < 2; ++table) {
+            if (!tables[table])
+                continue;
+            std::vector<Sym> syms(tables[table]->size() / sizeof (Sym));
+            tables[table]->readObj(0, syms.data(), syms.size());
+            for (uint32_t i = 0; i < syms.size(); ++i) {
+                const auto &sym = syms[i];
+                if (sym.st_shndx >= sectionHeaders.size())
+                    continue;
+                if (type != STT_NOTYPE && ELF_ST_TYPE(sym.st_info) != type)
+                    continue;
+                // Symbols in non-allocated sections are only useful as exact
+                // zero-sized matches.
+                if (sym.st_size != 0 && (sectionHeaders[sym.st_shndx].shdr.sh_flags & SHF_ALLOC) == 0)
+                    continue;
+                index.symbols.push_back(AddrSymbol{ sym.st_value, sym.st_value + sym.st_size, i, table });
+            }
+        }
+        std::sort(index.symbols.begin(), index.symbols.end(),
+                [] (const AddrSymbol &lhs, const AddrSymbol &rhs) { return lhs.value < rhs.value; });
+        IndexCache::store(*this, kind.c_str(), sources, index.symbols.data(), index.symbols.size());
+    }
+    index.maxEnd.reserve(index.symbols.size());
+    Addr maxEnd = 0;
+    for (auto &sym : index.symbols) {
+        maxEnd = std::max(maxEnd, sym.end);
+        index.maxEnd.push_back(maxEnd);
+    }
+    if (verbose >= 2)
+        *debug << "indexed " << index.symbols.size() << " symbols of type " << type
+            << " in " << *io << "\n";
+    return index;
+}
+
+void
+Object::getIndexedSymbol(const AddrSymbol &indexed, Sym &sym, string &name) const
+{
+    const auto &table = indexed.table == 0
+        ? commonSections->debugSymbols.symbols
+        : commonSections->dynamicSymbols.symbols;
+    const auto &strings = indexed.table == 0
+        ? commonSections->debugSymbols.strings
+        : commonSections->dynamicSymbols.strings;
+    sym = table->readObj<Sym>(indexed.index * sizeof (Sym));
+    name = strings->readString(sym.st_name);
+}
+
 /*
  * Find the symbol that represents a particular address.
  */
 bool
 Object::findSymbolByAddress(Addr addr, int type, Sym &sym, string &name)
 {
-    /* Try to find symbols in these sections */
-    bool haveExactZeroSizeMatch = false;
-
-    auto findSym = [type, addr, this, &sym, &name, &haveExactZeroSizeMatch ](auto &table) {
-        for (const auto &syminfo : table) {
-            auto &candidate = syminfo.symbol;
-            if (candidate.st_shndx >= sectionHeaders.size())
-                continue;
-            if (type != STT_NOTYPE && ELF_ST_TYPE(candidate.st_info) != type)
-                continue;
-            if (candidate.st_value > addr)
-                continue;
-            if (candidate.st_size + candidate.st_value <= addr) {
-                if (candidate.st_size == 0 && candidate.st_value == addr) {
-                    sym = candidate;
-                    name = syminfo.name;
-                    haveExactZeroSizeMatch = true;
-                }
-                continue;
-            }
-            auto &sec = sectionHeaders[candidate.st_shndx];
-            if ((sec.shdr.sh_flags & SHF_ALLOC) == 0)
-                continue;
-            sym = candidate;
-            name = syminfo.name;
-            return true;
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
+    const auto &index = getSymbolIndex(type);
+    const auto &syms = index.symbols;
+
+    // Of the symbols covering addr, prefer .symtab over .dynsym, and the
+    // earlier entry in either. If none covers it, we'll settle for the last
+    // zero-sized symbol at exactly addr.
+    const AddrSymbol *match = nullptr;
+    const AddrSymbol *exactZeroSizeMatch = nullptr;
+    auto order = [] (const AddrSymbol *sym) { return std::make_pair(sym->table, sym->index); };
+    auto it = std::upper_bound(syms.begin(), syms.end(), addr,
+            [] (Addr addr, const AddrSymbol &sym) { return addr < sym.value; });
+    for (size_t i = it - syms.begin(); i-- > 0; ) {
+        const auto &candidate = syms[i];
+        if (index.maxEnd[i] <= addr && candidate.value != addr)
+            break;
+        if (candidate.end > addr) {
+            if (match == nullptr || order(&candidate) < order(match))
+                match = &candidate;
+        } else if (candidate.end == addr && candidate.value == addr) {
+            if (exactZeroSizeMatch == nullptr || order(&candidate) > order(exactZeroSizeMatch))
+                exactZeroSizeMatch = &candidate;
         }
-        return false;
-    };
-    if (findSym(commonSections->debugSymbols)) {
-       return true;
     }
-    if (findSym(commonSections->dynamicSymbols)) {
-       return true;
+    if (match != nullptr) {
+        getIndexedSymbol(*match, sym, name);
+        return true;
     }
+    bool haveExactZeroSizeMatch = exactZeroSizeMatch != nullptr;
+    if (haveExactZeroSizeMatch)
+        getIndexedSymbol(*exactZeroSizeMatch, sym, name);
+
     // .gnu_debugdata is a separate LZMA-compressed ELF image with just
     // a symbol table.
     //
@@ -460,6 +529,7 @@ Object::findDynamicSymbol(const std::string &name)
 NamedSymbol
 Object::findDebugSymbol(const string &name)
 {
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
     auto &syment = cachedSymbols[name];
     if (syment.disposition == CachedSymbol::SYM_NEW) {
         auto found = commonSections->debugSymbols.linearSearch(name, syment.sym);
@@ -473,6 +543,7 @@ Object::~Object() = default;
 Object *
 Object::getDebug() const
 {
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
     if (!debugLoaded) {
         debugLoaded = true;
         auto &hdr = getSection(".gnu_debuglink", SHT_PROGBITS);
@@ -482,23 +553,10 @@ Object::getDebug() const
         auto dir = dirname(stringify(*io));
         debugObject = imageCache.getDebugImage(dir + "/" + link);
         if (!debugObject) {
-            for (const auto &note : notes) {
-                if (note.name() == "GNU" && note.type() == GNU_BUILD_ID) {
-                    std::ostringstream dir;
-                    dir << ".build-id/";
-                    size_t i;
-                    auto io = note.data();
-                    std::vector<unsigned char> data(io->size());
-                    io->readObj(0, &data[0], io->size());
-                    dir << std::hex << std::setw(2) << std::setfill('0') << int(data[0]);
-                    dir << "/";
-                    for (i = 1; i < size_t(io->size()); ++i)
-                        dir << std::setw(2) << int(data[i]);
-                    dir << ".debug";
-                    debugObject = imageCache.getDebugImage(dir.str());
-                    break;
-                }
-            }
+            auto buildID = getBuildID();
+            if (buildID.size() > 2)
+                debugObject = imageCache.getDebugImage(
+                      ".build-id/" + buildID.substr(0, 2) + "/" + buildID.substr(2) + ".debug");
         } else {
             if (verbose >= 2)
                 *debug << "found debug object " << *debugObject->io << " for " << *io << "\n";
@@ -524,6 +582,24 @@ Object::getDebug() const
     return debugObject.get();
 }
 
+std::string
+Object::getBuildID() const
+{
+    for (const auto &note : notes) {
+        if (note.name() == "GNU" && note.type() == GNU_BUILD_ID) {
+            std::ostringstream id;
+            auto io = note.data();
+            std::vector<unsigned char> data(io->size());
+            io->readObj(0, data.data(), data.size());
+            id << std::hex << std::setfill('0');
+            for (auto c : data)
+                id << std::setw(2) << int(c);
+            return id.str();
+        }
+    }
+    return "";
+}
+
 template <typename Symtype> bool
 SymbolSection<Symtype>::linearSearch(const string &name, Sym &sym) const
 {
@@ -613,25 +689,46 @@ Section::Section(const Reader::csptr &image, Off off)
 
 Object::sptr
 ImageCache::getImageForName(const string &name) {
-    auto res = getImageIfLoaded(name);
-    if (res != nullptr) {
-        return res;
-    }
-    auto item = make_shared<Object>(*this, std::make_shared<MmapReader>(name));
-    // don't cache negative entries: assign into the cache after we've constructed:
-    // a failure to load the image will throw.
-    cache[name] = item;
+    // Failures to load the image throw, and aren't cached.
+    bool hit;
+    elfLookups++;
+    auto item = cache.get(name, [this, &name] {
+        return make_shared<Object>(*this, std::make_shared<MmapReader>(name)); }, &hit);
+    if (hit)
+        elfHits++;
     return item;
 }
 
+namespace {
+// Holds the content of a VDSO for VDSOReader. It's a base class of
+// VDSOReader so it's constructed before the MemReader that refers to it.
+struct VDSOContent {
+    std::string content;
+};
+
+struct VDSOReader : private VDSOContent, public MemReader {
+    VDSOReader(std::string &&content_)
+        : VDSOContent { std::move(content_) }
+        , MemReader("(vdso image)", content.size(), content.data())
+    {}
+};
+}
+
+Object::sptr
+ImageCache::getVDSO(string &&content)
+{
+    return vdsoCache.get(content, [this, &content] {
+        return make_shared<Object>(*this, std::make_shared<VDSOReader>(string(content))); });
+}
+
 ImageCache::ImageCache() : elfHits(0), elfLookups(0) {}
 ImageCache::~ImageCache() {
     if (verbose >= 2) {
-        *debug << "ELF image cache: lookups: " << elfLookups << ", hits=" << elfHits << std::endl;
-        for (const auto &items : cache) {
-            assert(items.second);
-            *debug << "\t" << *items.second->io << std::endl;
-        }
+        *debug << "ELF image cache: lookups: " << elfLookups.load() << ", hits=" << elfHits.load() << std::endl;
+        cache.forEach([] (const string &, const Object::sptr &image) {
+            assert(image);
+            *debug << "\t" << *image->io << std::endl;
+        });
     }
 }
 
@@ -639,12 +736,10 @@ Object::sptr
 ImageCache::getImageIfLoaded(const string &name)
 {
     elfLookups++;
-    auto it = cache.find(name);
-    if (it != cache.end()) {
+    auto item = cache.find(name);
+    if (item)
         elfHits++;
-        return it->second;
-    }
-    return Object::sptr();
+    return item;
 }
 
 Object::sptr
@@ -669,12 +764,7 @@ ImageCache::getDebugImage(const string &name) {
 void
 ImageCache::flush(Object::sptr o)
 {
-   for (auto it = cache.begin(); it != cache.end(); ++it) {
-      if (it->second == o) {
-         cache.erase(it);
-         return;
-      }
-   }
+   cache.eraseValue(o);
 }
 
 VersionedSymbol::VersionedSymbol(const Sym &sym_, const std::string &name_, const Section &versionInfo, size_t idx)
@@ -0,0 +1,198 @@
+#include "libpstack/indexcache.h"
+#include "libpstack/util.h"
+
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+namespace Elf {
+
+std::string IndexCache::directory;
+
+namespace {
+
+/*
+ * The header is followed by the description of the index's sources, padded
+ * to a multiple of 8 bytes, and then the records.
+ */
+struct Header {
+    char magic[8];
+    uint32_t recordSize;
+    uint32_t elfBits;
+    uint64_t sourcesSize;
+    uint64_t count;
+};
+
+const char MAGIC[8] = { 'P', 'S', 'T', 'K', 'I', 'D', 'X', '2' };
+
+size_t
+recordsOffset(size_t sourcesSize)
+{
+    return sizeof (Header) + ((sourcesSize + 7) & ~size_t(7));
+}
+
+/*
+ * Find the path of the cache file for this index of this object, and the
+ * description of its sources, with a line for the object's file, then one
+ * for each source. Files' paths are part of the cache file's name, and the
+ * description has their sizes and modification times, and the sources'
+ * sizes, so we can tell if any has changed. Returns false if we can't cache
+ * indexes for the object.
+ */
+bool
+cachePath(const Object &obj, const char *kind, const IndexCache::Sources &sources,
+        std::string &path, std::string &description)
+{
+    if (IndexCache::directory == "")
+        return false;
+    auto buildID = obj.getBuildID();
+    if (buildID == "")
+        return false;
+
+    std::ostringstream names, details;
+    auto describe = [&] (const Reader *io) {
+        if (io == nullptr) {
+            names << "-\n";
+            details << "-\n";
+            return true;
+        }
+        auto file = io->filename();
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0)
+            return false;
+        names << file << "\n";
+        details << file << " " << st.st_size << " " << st.st_mtim.tv_sec << "."
+            << st.st_mtim.tv_nsec << " " << io->size() << "\n";
+        return true;
+    };
+    if (!describe(obj.io.get()))
+        return false;
+    for (auto &source : sources)
+        if (!describe(source.get()))
+            return false;
+
+    // FNV-1a hash of the names, so we keep an index for each set of files.
+    uint64_t hash = 0xcbf29ce484222325;
+    for (unsigned char c : names.str()) {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+    std::ostringstream os;
+    os << IndexCache::directory << "/" << buildID << "." << kind << "." << std::hex << hash;
+    path = os.str();
+    description = details.str();
+    return true;
+}
+
+}
+
+Reader::csptr
+IndexCache::loadRaw(const Object &obj, const char *kind, const Sources &sources,
+        size_t recordSize, const char **records, size_t *count)
+{
+    std::string path, description;
+    if (!cachePath(obj, kind, sources, path, description))
+        return nullptr;
+    if (access(path.c_str(), R_OK) != 0)
+        return nullptr;
+    try {
+        auto io = std::make_shared<MmapReader>(path);
+        auto hdr = reinterpret_cast<const Header *>(io->view(0, sizeof (Header)));
+        if (hdr == nullptr
+                || memcmp(hdr->magic, MAGIC, sizeof MAGIC) != 0
+                || hdr->recordSize != recordSize
+                || hdr->elfBits != ELF_BITS
+                || hdr->sourcesSize != description.size()) {
+            if (verbose > 0)
+                *debug << "ignoring stale or invalid index cache " << path << "\n";
+            return nullptr;
+        }
+        auto cachedDescription = io->view(sizeof (Header), description.size());
+        if (cachedDescription == nullptr
+                || memcmp(cachedDescription, description.data(), description.size()) != 0) {
+            if (verbose > 0)
+                *debug << "ignoring stale index cache " << path << "\n";
+            return nullptr;
+        }
+        // Check the count against the file's size before multiplying, so a
+        // corrupt one can't wrap around to something that fits.
+        size_t offset = recordsOffset(description.size());
+        size_t fileSize = io->size();
+        auto data = offset <= fileSize && hdr->count <= (fileSize - offset) / recordSize
+            ? io->view(offset, hdr->count * recordSize)
+            : nullptr;
+        if (data == nullptr) {
+            if (verbose > 0)
+                *debug << "ignoring truncated index cache " << path << "\n";
+            return nullptr;
+        }
+        *records = data;
+        *count = hdr->count;
+        if (verbose >= 2)
+            *debug << "loaded " << *count << " entries from index cache " << path << "\n";
+        return io;
+    }
+    catch (const std::exception &ex) {
+        if (verbose > 0)
+            *debug << "can't load index cache " << path << ": " << ex.what() << "\n";
+        return nullptr;
+    }
+}
+
+void
+IndexCache::storeRaw(const Object &obj, const char *kind, const Sources &sources,
+        size_t recordSize, const void *records, size_t count)
+{
+    std::string path, description;
+    if (!cachePath(obj, kind, sources, path, description))
+        return;
+
+    Header hdr;
+    memcpy(hdr.magic, MAGIC, sizeof MAGIC);
+    hdr.recordSize = recordSize;
+    hdr.elfBits = ELF_BITS;
+    hdr.sourcesSize = description.size();
+    hdr.count = count;
+    description.resize(recordsOffset(description.size()) - sizeof hdr);
+
+    // Write to a temporary file, and rename it into place, so concurrent
+    // readers never see a partial index. The name's unique, as other threads
+    // (in fleet mode) or processes may be writing the same index.
+    mkdir(directory.c_str(), 0777);
+    std::string tmp = path + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd == -1) {
+        if (verbose > 0)
+            *debug << "can't create index cache " << tmp << ": " << strerror(errno) << "\n";
+        return;
+    }
+    fchmod(fd, 0644); // mkstemp's file is only readable by us.
+    bool ok = write(fd, &hdr, sizeof hdr) == ssize_t(sizeof hdr)
+        && write(fd, description.data(), description.size()) == ssize_t(description.size());
+    size_t size = recordSize * count;
+    for (auto p = static_cast<const char *>(records); ok && size != 0; ) {
+        auto rc = write(fd, p, size);
+        ok = rc > 0;
+        if (ok) {
+            p += rc;
+            size -= rc;
+        }
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        if (verbose > 0)
+            *debug << "can't write index cache " << path << ": " << strerror(errno) << "\n";
+        unlink(tmp.c_str());
+        return;
+    }
+    if (verbose >= 2)
+        *debug << "stored " << count << " entries in index cache " << path << "\n";
+}
+
+}
@@ -6,12 +6,20 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <stack>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <iterator>
 #include <cassert>
+#include <array>
+
+#ifndef MAX_DWARF_REGS
+#define REGMAP(number, field)
+#include <libpstack/dwarf/archreg.h>
+#undef REGMAP
+#endif
 
 namespace Dwarf {
 
@@ -19,6 +27,7 @@ enum HasChildren { DW_CHILDREN_yes = 1, DW_CHILDREN_no = 0 };
 
 class Attribute;
 class DIE;
+class DIEArena;
 class DIEIter;
 class DWARFReader;
 class ExpressionStack;
@@ -26,6 +35,7 @@ class Info;
 class LineInfo;
 class RawDIE;
 class Unit;
+struct UnitAddrIndex;
 struct CFI;
 struct CIE;
 
@@ -130,7 +140,7 @@ union Value {
     uintmax_t signature;
     uintmax_t udata;
     intmax_t sdata;
-    Block *block;
+    Block block;
     bool flag;
 };
 
@@ -222,7 +232,7 @@ public:
     explicit operator uintmax_t() const;
     explicit operator bool() const { return valid() && value().flag; }
     explicit operator DIE() const;
-    explicit operator const Block &() const { return *value().block; }
+    explicit operator const Block &() const { return value().block; }
     AttrName name() const;
 };
 
@@ -266,6 +276,33 @@ public:
     LineState(LineInfo *);
 };
 
+/*
+ * A row of the line number matrix, as stored: LineState is the state machine
+ * that generates these while decoding the program.
+ */
+struct LineRow {
+    Elf::Addr addr;
+    uint32_t line;
+    uint32_t file; // index into LineInfo::files
+    uint16_t column:11; // saturates at 2047
+    bool is_stmt:1;
+    bool basic_block:1;
+    bool end_sequence:1;
+    bool prologue_end:1;
+    bool epilogue_begin:1;
+};
+
+/*
+ * A sequence of rows in the matrix, covering the address range [low, high),
+ * from matrix[first] to the end_sequence row at matrix[last].
+ */
+struct LineSequence {
+    Elf::Addr low;
+    Elf::Addr high;
+    uint32_t first;
+    uint32_t last;
+};
+
 class LineInfo {
     LineInfo(const LineInfo &) = delete;
 public:
@@ -275,8 +312,11 @@ public:
     std::vector<int> opcode_lengths;
     std::vector<std::string> directories;
     std::vector<FileEntry> files;
-    std::vector<LineState> matrix;
+    std::vector<LineRow> matrix;
+    std::vector<LineSequence> sequences; // sorted by low address.
     void build(DWARFReader &, const Unit *);
+    // find the row describing addr, or null if there is none.
+    const LineRow *findRow(Elf::Addr addr) const;
 };
 
 
@@ -286,12 +326,13 @@ class Unit : public std::enable_shared_from_this<Unit> {
     std::unique_ptr<LineInfo> lines;
     std::unordered_map<size_t, Abbreviation> abbreviations;
     Elf::Off topDIEOffset;
-    using AllEntries = std::unordered_map<Elf::Off, std::shared_ptr<RawDIE>>;
+    using AllEntries = std::unordered_map<Elf::Off, RawDIE *>;
     AllEntries allEntries;
-    std::shared_ptr<RawDIE> decodeEntry(const DIE &parent, Elf::Off offset);
+    std::shared_ptr<DIEArena> arena; // owns the RawDIEs in allEntries.
+    RawDIE *decodeEntry(const DIE &parent, Elf::Off offset);
     UnitType unitType;
 public:
-    void purge(); // Remove all RawDIEs from allEntries, potentially freeing memory.
+    void purge(); // Drop all RawDIEs and their arena, potentially freeing memory.
     bool isRoot(const DIE &die) { return die.getOffset() == topDIEOffset; }
     size_t entryCount() const { return allEntries.size(); }
     typedef std::shared_ptr<Unit> sptr;
@@ -365,7 +406,7 @@ struct FDE {
     Elf::Off end;
     Elf::Off cieOff;
     std::vector<unsigned char> augmentation;
-    FDE(CFI *, DWARFReader &, Elf::Off cieOff_, Elf::Off endOff_);
+    FDE(const CFI *, DWARFReader &, Elf::Off cieOff_, Elf::Off endOff_);
 };
 
 enum RegisterType {
@@ -391,7 +432,9 @@ struct RegisterUnwind {
 };
 
 struct CallFrame {
-    std::map<int, RegisterUnwind> registers;
+    // rules for each register, indexed by DWARF register number. Only the
+    // registers in archreg.h are used.
+    std::array<RegisterUnwind, MAX_DWARF_REGS> registers;
     int cfaReg;
     RegisterUnwind cfaValue;
     CallFrame();
@@ -418,23 +461,64 @@ struct CIE {
     CallFrame execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const;
 };
 
+/*
+ * A DWARF expression from a CFA program, decoded once so unwinding doesn't
+ * re-parse its bytes for each frame. Each op keeps its DWARF opcode, with
+ * constants folded to DW_OP_constu, and base registers to DW_OP_bregx. If
+ * the expression uses an op we don't compile, "compiled" is false, and it
+ * must be interpreted from the original bytes.
+ */
+struct CFIExpression {
+    struct Op {
+        uint8_t op;
+        int reg;
+        intmax_t operand;
+    };
+    std::vector<Op> ops;
+    bool compiled;
+};
+
 /*
  * CFI represents call frame information (generally contents of .debug_frame or .eh_frame)
+ *
+ * If we are given the .eh_frame_hdr section for an .eh_frame, and it has a
+ * binary search table, we use that to locate FDEs, and decode each FDE (and
+ * its CIE) only when it's first needed. Otherwise, we decode the entire
+ * section when constructed.
+ *
+ * Lookups via findFDE and getCIE may be made from concurrent threads.
  */
 struct CFI {
     const Info *dwarf;
     Elf::Addr sectionAddr; // virtual address of this section  (may need to be offset by load address)
     Reader::csptr io;
     FIType type;
-    std::map<Elf::Addr, CIE> cies;
-    std::list<FDE> fdeList;
-    CFI(Info *, Elf::Addr addr, Reader::csptr io, FIType);
+    mutable std::map<Elf::Addr, CIE> cies;
+    CFI(Info *, Elf::Addr addr, Reader::csptr io, FIType, const Elf::Section *hdr = nullptr);
     CFI() = delete;
     CFI(const CFI &) = delete;
-    Elf::Addr decodeCIEFDEHdr(DWARFReader &, FIType, Elf::Off *cieOff); // cieOFF set to -1 if this is CIE, set to offset of associated CIE for an FDE
+    Elf::Addr decodeCIEFDEHdr(DWARFReader &, FIType, Elf::Off *cieOff) const; // cieOFF set to -1 if this is CIE, set to offset of associated CIE for an FDE
     const FDE *findFDE(Elf::Addr) const;
-    bool isCIE(Elf::Addr);
+    const CIE *getCIE(Elf::Off) const;
+    const CFIExpression &expression(const Block &) const; // compiled on first use.
+    const std::vector<FDE> &getFDEs() const; // decodes all FDEs if we've not done so yet.
+    bool isCIE(Elf::Addr) const;
     intmax_t decodeAddress(DWARFReader &, int encoding) const;
+private:
+    // Protects the lazily-decoded state below, and cies.
+    mutable std::mutex lock;
+    void ensureCIE(Elf::Off) const;
+    const FDE *decodeFDE(Elf::Off) const;
+    const std::vector<FDE> &decodeFDEs() const;
+    const char *cacheKind() const; // name of our search table in the IndexCache.
+    bool parseSearchTable(const Elf::Section &hdr);
+    mutable std::vector<FDE> fdeList; // sorted by iloc, so findFDE can binary-search.
+    mutable bool fdeListDecoded = false;
+    // From .eh_frame_hdr, or the IndexCache: initial location of each FDE,
+    // and its offset in io.
+    std::vector<std::pair<Elf::Addr, Elf::Off>> searchTable;
+    mutable std::map<Elf::Off, FDE> fdesByOffset; // FDEs decoded via searchTable.
+    mutable std::unordered_map<Elf::Off, CFIExpression> expressions; // by offset in io.
 };
 
 struct ARanges {
@@ -453,7 +537,8 @@ public:
     typedef std::shared_ptr<Info> sptr;
     typedef std::shared_ptr<const Info> csptr;
     Reader::csptr io; // XXX: io is public because "block" Attributes need to read from it.
-    std::map<Elf::Addr, CallFrame> callFrameForAddr;
+    std::unordered_map<Elf::Addr, CallFrame> callFrameForAddr;
+    std::mutex callFrameLock; // protects callFrameForAddr
     Elf::Object::sptr elf;
     std::unique_ptr<CFI> debugFrame;
     std::unique_ptr<CFI> ehFrame;
@@ -470,11 +555,17 @@ public:
     Ranges rangesAt(Elf::Off) const;
     bool hasARanges() const;
     Unit::sptr lookupUnit(Elf::Addr addr) const;
+    // Find the subprogram containing addr, followed by the chain of inlined
+    // subroutines within it that also contain it, from outermost to innermost.
+    std::vector<DIE> functionsForAddr(Elf::Addr addr) const;
     std::vector<std::pair<std::string, int>> sourceFromAddr(uintmax_t addr) const;
     mutable Reader::csptr strOffsets;
 
 private:
     void decodeARangeSet(DWARFReader &) const;
+    bool loadARanges(const char *kind) const;
+    void storeARanges(const char *kind) const;
+    std::vector<Reader::csptr> aRangeSources(const char *kind) const;
     std::string getAltImageName() const;
     mutable std::list<PubnameUnit> pubnameUnits;
     // These are mutable so we can lazy-eval them when getters are called, and
@@ -490,6 +581,8 @@ private:
     bool haveLines;
     bool haveARanges;
     mutable bool unitRangesCached = false;
+    // function address indices, built on demand, by unit offset.
+    mutable std::map<Elf::Off, std::unique_ptr<UnitAddrIndex>> addrIndices;
 };
 
 /*
@@ -497,9 +590,9 @@ private:
  * Objects also.
  */
 class ImageCache : public Elf::ImageCache {
-    int dwarfHits;
-    int dwarfLookups;
-    std::map<Elf::Object::sptr, Info::sptr> dwarfCache;
+    std::atomic<int> dwarfHits;
+    std::atomic<int> dwarfLookups;
+    ConcurrentCache<Elf::Object::sptr, Info::sptr> dwarfCache;
 public:
     Info::sptr getDwarf(const std::string &);
     Info::sptr getDwarf(Elf::Object::sptr);
@@ -547,7 +640,33 @@ enum CFAInstruction {
 class DWARFReader {
     Elf::Off off;
     Elf::Off end;
+    // The decoding primitives work from an in-memory window of the
+    // underlying reader's content, covering [winStart, winEnd). If the reader
+    // has its content in memory, the window is the entire thing, otherwise,
+    // we refill the window from io. Lots of readers only decode a handful of
+    // bytes, so the first fill is small, and uses inline storage: each
+    // subsequent fill doubles in size, up to MAXWINDOW bytes.
+    static const size_t MINWINDOW = 64;
+    static const size_t MAXWINDOW = 4096;
+    const unsigned char *winData;
+    Elf::Off winStart;
+    Elf::Off winEnd;
+    bool viewed;
+    size_t nextFill;
+    unsigned char smallWindow[MINWINDOW];
+    std::vector<unsigned char> window;
     uintmax_t getuleb128shift(int &shift, bool &msb);
+    bool fill(size_t len);
+    bool inWindow(size_t len) const {
+        return off >= winStart && off <= winEnd && len <= winEnd - off;
+    }
+    void getbytes(void *p, size_t len) {
+        if (inWindow(len) || fill(len))
+            memcpy(p, winData + (off - winStart), len);
+        else
+            io->readObj(off, (unsigned char *)p, len);
+        off += len;
+    }
 public:
     ::Reader::csptr io;
     unsigned addrLen;
@@ -555,33 +674,48 @@ public:
     DWARFReader(Reader::csptr io_, Elf::Off off_ = 0, size_t end_ = std::numeric_limits<size_t>::max())
         : off(off_)
         , end(end_ == std::numeric_limits<size_t>::max() ? io_->size() : end_)
+        , winStart(0)
+        , winEnd(io_->size())
+        , nextFill(MINWINDOW)
         , io(std::move(io_))
         , addrLen(ELF_BITS / 8) {
+        winData = (const unsigned char *)io->view(0, winEnd);
+        viewed = winData != nullptr;
+        if (!viewed)
+            winEnd = 0;
     }
+    DWARFReader(const DWARFReader &rhs)
+        : off(rhs.off)
+        , end(rhs.end)
+        , winData(rhs.viewed ? rhs.winData : nullptr)
+        , winStart(0)
+        , winEnd(rhs.viewed ? rhs.winEnd : 0)
+        , viewed(rhs.viewed)
+        , nextFill(MINWINDOW)
+        , io(rhs.io)
+        , addrLen(rhs.addrLen) {
+    }
+    DWARFReader &operator = (const DWARFReader &) = delete;
 
     uint32_t getu32() {
         unsigned char q[4];
-        io->readObj(off, q, 4);
-        off += sizeof q;
+        getbytes(q, 4);
         return q[0] | q[1] << 8 | q[2] << 16 | uint32_t(q[3] << 24);
     }
     uint16_t getu16() {
         unsigned char q[2];
-        io->readObj(off, q, 2);
-        off += sizeof q;
+        getbytes(q, 2);
         return q[0] | q[1] << 8;
     }
     uint8_t getu8() {
+        if (inWindow(1) || fill(1))
+            return winData[off++ - winStart];
         unsigned char q;
-        io->readObj(off, &q, 1);
-        off++;
+        getbytes(&q, 1);
         return q;
     }
     int8_t gets8() {
-        int8_t q;
-        io->readObj(off, &q, 1);
-        off += 1;
-        return q;
+        return int8_t(getu8());
     }
     uintmax_t getuint(int len) {
         uintmax_t rc = 0;
@@ -589,8 +723,7 @@ public:
         uint8_t bytes[16];
         if (len > 16)
             throw Exception() << "can't deal with ints of size " << len;
-        io->readObj(off, bytes, len);
-        off += len;
+        getbytes(bytes, len);
         uint8_t *p = bytes + len;
         for (i = 1; i <= len; i++)
             rc = rc << 8 | p[-i];
@@ -602,8 +735,7 @@ public:
         uint8_t bytes[16];
         if (len > 16 || len < 1)
             throw Exception() << "can't deal with ints of size " << len;
-        io->readObj(off, bytes, len);
-        off += len;
+        getbytes(bytes, len);
         uint8_t *p = bytes + len;
         rc = (p[-1] & 0x80) ? -1 : 0;
         for (i = 1; i <= len; i++)
@@ -627,6 +759,19 @@ public:
     }
 
     std::string getstring() {
+        if (inWindow(1) || fill(1)) {
+            auto start = (const char *)winData + (off - winStart);
+            auto nul = (const char *)memchr(start, 0, winEnd - off);
+            if (nul == nullptr && !viewed && fill(winEnd - off + 1)) {
+                // string straddles the window - refill starting at the string.
+                start = (const char *)winData;
+                nul = (const char *)memchr(start, 0, winEnd - off);
+            }
+            if (nul != nullptr) {
+                off += nul - start + 1;
+                return std::string(start, nul - start);
+            }
+        }
         std::string s = io->readString(off);
         off += s.size() + 1;
         return s;
@@ -693,6 +838,7 @@ enum ExpressionOp {
 #define DW_EH_PE_datarel        0x30
 #define DW_EH_PE_funcrel        0x40
 #define DW_EH_PE_aligned        0x50
+#define DW_EH_PE_omit   0xff
 }
 std::ostream &operator << (std::ostream &os, const JSON<Dwarf::Info> &);
 std::ostream &operator << (std::ostream &os, const JSON<Dwarf::UnitType> &);
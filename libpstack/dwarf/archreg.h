@@ -1,9 +1,13 @@
-/* Maps from DWARF register numbers to pt_regs fields for each architecture. */
+/*
+ * Maps from DWARF register numbers to pt_regs fields for each architecture.
+ * MAX_DWARF_REGS is one more than the largest register number mapped.
+ */
 #ifdef __i386__
 #define IPREG 8
 #define BPREG 5
 #define SPREG 4
 #define CFA_RESTORE_REGNO 4
+#define MAX_DWARF_REGS 15
 REGMAP(0, eax)
 REGMAP(1, ecx)
 REGMAP(2, edx)
@@ -26,6 +30,7 @@ REGMAP(14, xfs)
 #define IPREG 16
 #define SPREG 7
 #define BPREG 6
+#define MAX_DWARF_REGS 60
 REGMAP(0, rax)
 REGMAP(1, rdx)
 REGMAP(2, rcx)
@@ -92,6 +97,7 @@ REGMAP(59, gs_base)
 #if ELF_BITS == 32
 #define IPREG 15
 #define CFA_RESTORE_REGNO 13
+#define MAX_DWARF_REGS 18
 
 REGMAP(0, regs[0])
 REGMAP(1, regs[1])
@@ -114,6 +120,7 @@ REGMAP(17, regs[17])
 #else
 #define IPREG 32
 #define CFA_RESTORE_REGNO 13
+#define MAX_DWARF_REGS 33
 REGMAP(0, regs[0])
 REGMAP(1, regs[1])
 REGMAP(2, regs[2])
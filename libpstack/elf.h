@@ -36,12 +36,14 @@
 
 #include <elf.h>
 
+#include <atomic>
 #include <tuple>
 #include <string>
 #include <list>
 #include <vector>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <limits>
 
 #include "libpstack/util.h"
@@ -295,6 +297,8 @@ public:
 
     // Misc operations
     std::string getInterpreter() const;
+    // GNU build ID of the object as a hex string, or "" if it has none.
+    std::string getBuildID() const;
     const Ehdr &getHeader() const { return elfHeader; }
     const Phdr *getSegmentForAddress(Off) const;
     Notes notes;
@@ -314,6 +318,10 @@ private:
     std::map<std::string, Section *> namedSection;
     std::map<Word, ProgramHeaders> programHeaders;
 
+    // Protects the lazily-loaded state: debugObject, debugData,
+    // cachedSymbols and symbolIndices. Loading the debug object looks up
+    // sections in this object, so the same thread may take it again.
+    mutable std::recursive_mutex lazyLock;
     mutable bool debugLoaded; // We've at least attempted to load debugObject: don't try again
     mutable Object::sptr debugObject; // debug object as per .gnu_debuglink/other.
 
@@ -327,7 +335,24 @@ private:
         CachedSymbol() : disposition { SYM_NEW } {}
     };
     std::map<std::string, CachedSymbol> cachedSymbols;
-    mutable const Phdr *lastSegmentForAddress; // cache of last segment returned for a specific address.
+    mutable std::atomic<const Phdr *> lastSegmentForAddress; // cache of last segment returned for a specific address.
+
+    // Symbols from .symtab and .dynsym sorted by address, for
+    // findSymbolByAddress. maxEnd[i] is the highest end address of
+    // symbols[0..i], so we know when to stop scanning backwards.
+    struct AddrSymbol {
+        Addr value;
+        Addr end;
+        uint32_t index; // index of the symbol in its table
+        uint32_t table; // 0 for .symtab, 1 for .dynsym
+    };
+    struct SymbolIndex {
+        std::vector<AddrSymbol> symbols;
+        std::vector<Addr> maxEnd;
+    };
+    std::map<int, SymbolIndex> symbolIndices; // by symbol type.
+    const SymbolIndex &getSymbolIndex(int type);
+    void getIndexedSymbol(const AddrSymbol &, Sym &, std::string &) const;
 };
 // These are the architecture specific types representing the NT_PRSTATUS registers.
 #if defined(__PPC)
@@ -449,9 +474,10 @@ extern GlobalDebugDirectories globalDebugDirectories;
  * & st_ino + st_dev)
  */
 class ImageCache {
-    std::map<std::string, Object::sptr> cache;
-    int elfHits;
-    int elfLookups;
+    ConcurrentCache<std::string, Object::sptr> cache;
+    ConcurrentCache<std::string, Object::sptr> vdsoCache; // keyed by image content.
+    std::atomic<int> elfHits;
+    std::atomic<int> elfLookups;
 public:
     ImageCache();
     virtual ~ImageCache();
@@ -459,6 +485,9 @@ public:
     Object::sptr getImageForName(const std::string &name);
     Object::sptr getImageIfLoaded(const std::string &name);
     Object::sptr getDebugImage(const std::string &name);
+    // An image of a VDSO with the given content. Processes running on the
+    // same kernel share the image, and the DWARF data for it.
+    Object::sptr getVDSO(std::string &&content);
 };
 
 } // Elf namespace
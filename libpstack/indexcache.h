@@ -0,0 +1,67 @@
+#ifndef LIBPSTACK_INDEXCACHE_H
+#define LIBPSTACK_INDEXCACHE_H
+#include "libpstack/elf.h"
+
+#include <type_traits>
+#include <vector>
+
+namespace Elf {
+
+/*
+ * An on-disk cache of indexes we derive from ELF and DWARF content, so
+ * repeated runs don't have to build them again.
+ *
+ * Each index is a flat array of fixed-size records, stored in its own file
+ * in the cache directory, named for the GNU build-id of the object it was
+ * built from, the kind of index, and the files it was built from. Those
+ * aren't always the object's own: a stripped object's symbols or DWARF may
+ * come from a separate debug file, or not, depending on whether it's there.
+ *
+ * So each index comes with its "sources": the readers for the content it
+ * was built from, like the symbol tables an index of symbols refers to. The
+ * file records the path, size and modification time of the file behind the
+ * object and each source, and the size of each source, and an index is only
+ * used if those all still match. Loading an index maps its file into memory.
+ *
+ * Caching is disabled if "directory" is empty, or the object has no build-id.
+ */
+class IndexCache {
+public:
+    // The content an index was built from. Sources may be null, for content
+    // the object doesn't have.
+    using Sources = std::vector<Reader::csptr>;
+private:
+    static Reader::csptr loadRaw(const Object &, const char *kind, const Sources &,
+            size_t recordSize, const char **records, size_t *count);
+    static void storeRaw(const Object &, const char *kind, const Sources &,
+            size_t recordSize, const void *records, size_t count);
+public:
+    static std::string directory;
+
+    // The records of a loaded index. The mapping of the file is held by "io".
+    template <typename T> struct Index {
+        Reader::csptr io;
+        const T *records = nullptr;
+        size_t count = 0;
+        const T *begin() const { return records; }
+        const T *end() const { return records + count; }
+    };
+
+    template <typename T> static bool load(const Object &obj, const char *kind,
+            const Sources &sources, Index<T> &index) {
+        static_assert(std::is_trivially_copyable<T>::value, "index records must be trivially copyable");
+        const char *records;
+        index.io = loadRaw(obj, kind, sources, sizeof (T), &records, &index.count);
+        index.records = reinterpret_cast<const T *>(records);
+        return index.io != nullptr;
+    }
+
+    template <typename T> static void store(const Object &obj, const char *kind,
+            const Sources &sources, const T *records, size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "index records must be trivially copyable");
+        storeRaw(obj, kind, sources, sizeof (T), records, count);
+    }
+};
+
+}
+#endif
@@ -63,7 +63,9 @@ struct StackFrame {
     Elf::Addr rawIP() const;
     Elf::Addr scopeIP() const;
     Elf::Addr cfa;
-    std::map<unsigned, cpureg_t> regs;
+    // register values, indexed by DWARF register number, and which are set.
+    std::array<cpureg_t, MAX_DWARF_REGS> regs;
+    std::bitset<MAX_DWARF_REGS> regValid;
     Elf::Object::sptr elf;
     Elf::Addr elfReloc;
     const Elf::Phdr *phdr;
@@ -71,10 +73,11 @@ struct StackFrame {
     CFI *frameInfo;
     const FDE *fde;
     const CIE *cie;
-    Dwarf::DIE function;
+    mutable Dwarf::DIE function; // filled in when the frame is symbolized.
     UnwindMechanism mechanism;
     StackFrame(UnwindMechanism mechanism)
         : cfa(0)
+        , regs()
         , elfReloc(0)
         , phdr(0)
         , dwarf(0)
@@ -85,12 +88,14 @@ struct StackFrame {
     {}
     StackFrame(const StackFrame &prev, UnwindMechanism mechanism)
        : StackFrame(mechanism)
-       { regs = prev.regs; }
+       { regs = prev.regs; regValid = prev.regValid; }
+    StackFrame(const StackFrame &) = default;
     StackFrame &operator = (const StackFrame &) = delete;
     void setReg(unsigned, cpureg_t);
     cpureg_t getReg(unsigned regno) const;
     Elf::Addr getCFA(const Process &, const CallFrame &) const;
-    StackFrame *unwind(Process &p);
+    Elf::Addr evalCFIExpression(const Process &, const Block &, bool pushCFA) const;
+    bool unwind(Process &p, StackFrame &out);
     void setCoreRegs(const Elf::CoreRegisters &);
     void getCoreRegs(Elf::CoreRegisters &) const;
     void getFrameBase(const Process &, intmax_t, ExpressionStack *) const;
@@ -99,14 +104,10 @@ struct StackFrame {
 
 struct ThreadStack {
     td_thrinfo_t info;
-    std::vector<Dwarf::StackFrame *> stack;
+    std::vector<Dwarf::StackFrame> stack;
     ThreadStack() {
         memset(&info, 0, sizeof info);
     }
-    ~ThreadStack() {
-        for (auto i = stack.begin(); i != stack.end(); ++i)
-            delete *i;
-    }
     void unwind(Process &, Elf::CoreRegisters &regs);
 };
 
@@ -133,6 +134,26 @@ struct Lwp {
 typedef std::vector<std::pair<std::string, std::string>> PathReplacementList;
 struct PrintableFrame;
 
+/*
+ * Symbolic information about the code at an instruction address, for
+ * printing stack frames. The Process caches these by address, so each is
+ * looked up only once, however many frames of however many threads it
+ * appears in.
+ */
+struct FrameSymbols {
+    Dwarf::DIE function;
+    std::string dieName;
+    std::vector<Dwarf::DIE> inlined; // inlined functions within "function", outermost first.
+    std::vector<std::string> inlinedNames;
+    Elf::Sym symbol;
+    std::string symName;
+    bool haveSym;
+    Elf::Addr functionOffset; // max value of Elf::Addr if unknown.
+    bool sourceResolved; // set when "source" has been looked up.
+    std::vector<std::pair<std::string, int>> source;
+    FrameSymbols();
+};
+
 
 struct ProcessLocation {
 };
@@ -143,16 +164,19 @@ class Process : public ps_prochandle {
     Elf::Addr interpBase;
     void loadSharedObjects(Elf::Addr);
     Elf::Addr vdsoBase;
+    mutable std::map<Elf::Addr, FrameSymbols> symbolCache; // see frameSymbols
 
 protected:
     td_thragent_t *agent;
     Elf::Object::sptr execImage;
-    Elf::Object::sptr vdsoImage;
     std::string abiPrefix;
     const PathReplacementList &pathReplacements;
 
 public:
     Elf::Addr sysent; // for AT_SYSINFO
+    // How long the process was stopped for the last time stopProcess was
+    // called, in microseconds, or -1 if that's not meaningful.
+    intmax_t lastStopDuration;
     std::map<pid_t, Lwp> lwps;
     Dwarf::ImageCache &imageCache;
     std::map<Elf::Addr, Elf::Object::sptr> objects;
@@ -160,6 +184,9 @@ public:
     Reader::sptr io;
 
     virtual bool getRegs(lwpid_t pid, Elf::CoreRegisters *reg) = 0;
+    // Find the extent of the memory mapping containing "addr". Returns false
+    // if there's none, or we can't tell.
+    virtual bool findMapping(Elf::Addr addr, Elf::Addr *start, Elf::Addr *end) const = 0;
     void addElfObject(Elf::Object::sptr obj, Elf::Addr load);
     // Find the the object (and its load address) and segment containing a given address
     std::tuple<Elf::Addr, Elf::Object::sptr, const Elf::Phdr *> findSegment(Elf::Addr addr) const;
@@ -172,8 +199,15 @@ public:
     virtual void resumeProcess() = 0;
     virtual void resume(pid_t lwpid) = 0;
     std::ostream &dumpStackText(std::ostream &, const ThreadStack &, const PstackOptions &) const;
-    std::ostream &dumpFrameText(std::ostream &, const PrintableFrame &, Dwarf::StackFrame *) const;
+    std::ostream &dumpFrameText(std::ostream &, const PrintableFrame &, const Dwarf::StackFrame *) const;
     std::ostream &dumpStackJSON(std::ostream &, const ThreadStack &) const;
+    // The names of the function containing "addr", followed by those of
+    // the inlined functions within it that also contain it, outermost first.
+    std::vector<std::string> functionNames(Elf::Addr addr);
+    // The symbols for "addr", within "elf", loaded at "reloc". We include
+    // source details if "withSource" is set.
+    const FrameSymbols &frameSymbols(Elf::Addr addr, const Elf::Object::sptr &elf,
+          const Dwarf::Info::sptr &dwarf, Elf::Addr reloc, bool withSource) const;
     template <typename T> void listThreads(const T &);
 
 
@@ -202,6 +236,27 @@ Process::listThreads(const T &callback)
             (void *)&callback, TD_THR_ANY_STATE, TD_THR_LOWEST_PRIORITY, TD_SIGNO_MASK, TD_THR_ANY_USER_FLAGS);
 }
 
+/*
+ * A reader for process memory that serves reads from copies of regions of
+ * memory taken earlier, and anything else from the process itself. This
+ * lets us take copies of thread stacks while the process is stopped, and
+ * unwind them after it's resumed. Once the captures are taken, reads are
+ * safe from concurrent threads if the upstream reader's are.
+ */
+class SnapshotReader : public Reader {
+    Reader::csptr upstream;
+    std::map<Elf::Addr, std::vector<char>> captures; // keyed by start address
+public:
+    SnapshotReader(Reader::csptr upstream_) : upstream(std::move(upstream_)) {}
+    // copy each region of memory, given as address and length, from upstream now.
+    void capture(const std::vector<std::pair<Elf::Addr, size_t>> &regions);
+    virtual size_t read(off_t off, size_t count, char *ptr) const override;
+    void readBatch(Request *requests, size_t count) const override;
+    void describe(std::ostream &os) const override { os << *upstream; }
+    off_t size() const override { return upstream->size(); }
+    std::string filename() const override { return upstream->filename(); }
+};
+
 class LiveReader : public FileReader {
 public:
     off_t size() const override { return std::numeric_limits<off_t>::max(); }
@@ -211,13 +266,43 @@ public:
 // Name of the file /proc/<pid>/name, after symlink dereferencing
 std::string procname(pid_t pid, const std::string &);
 
+/*
+ * Reads memory of a live process with process_vm_readv, which can read a
+ * batch of scattered regions in a single system call. If process_vm_readv
+ * isn't available, or "enabled" is false, we read /proc/<pid>/mem instead.
+ */
+class ProcessVMReader : public Reader {
+    pid_t pid;
+    LiveReader procMem;
+    mutable std::atomic<bool> useProcMem;
+    mutable std::atomic<unsigned long> requests;
+    mutable std::atomic<unsigned long> syscalls;
+    bool fallback(int err) const;
+public:
+    static bool enabled;
+    ProcessVMReader(pid_t);
+    ~ProcessVMReader();
+    virtual size_t read(off_t off, size_t count, char *ptr) const override;
+    void readBatch(Request *requests, size_t count) const override;
+    // We describe ourselves as /proc/<pid>/mem, as that's what we're reading.
+    void describe(std::ostream &os) const override { procMem.describe(os); }
+    off_t size() const override { return procMem.size(); }
+    std::string filename() const override { return procMem.filename(); }
+};
+
 struct LiveThreadList;
 class LiveProcess : public Process {
     pid_t pid;
+    std::shared_ptr<CacheReader> memCache; // flushed on resume: "io" may be replaced.
+    timeval processStoppedAt;
+    // Sorted extents of the mappings from /proc/<pid>/maps, read on demand
+    // while the process is stopped.
+    mutable std::vector<std::pair<Elf::Addr, Elf::Addr>> mappings;
     friend class LiveReader;
 public:
     LiveProcess(Elf::Object::sptr &, pid_t, const PathReplacementList &, Dwarf::ImageCache &);
     virtual bool getRegs(lwpid_t pid, Elf::CoreRegisters *reg) override;
+    bool findMapping(Elf::Addr, Elf::Addr *, Elf::Addr *) const override;
     virtual void stop(pid_t) override;
     virtual void resume(pid_t) override;
     void stopProcess() override;
@@ -245,6 +330,7 @@ class CoreProcess : public Process {
 public:
     CoreProcess(Elf::Object::sptr exec, Elf::Object::sptr core, const PathReplacementList &, Dwarf::ImageCache &);
     virtual bool getRegs(lwpid_t pid, Elf::CoreRegisters *reg) override;
+    bool findMapping(Elf::Addr, Elf::Addr *, Elf::Addr *) const override;
     virtual void stop(lwpid_t) override;
     virtual void resume(lwpid_t) override;
     void stopProcess() override;
@@ -3,14 +3,20 @@
 
 #include <exception>
 #include <cassert>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <limits>
 #include <vector>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdio.h>
 #include <string>
 #include <string.h>
+#include <thread>
 #include <unordered_map>
 
 
@@ -113,6 +119,17 @@ public:
     // read a sequence of count bytes at offset off. May give a short return.
     virtual size_t read(off_t off, size_t count, char *ptr) const = 0;
 
+    // One of a batch of independent reads, for readBatch.
+    struct Request {
+        off_t offset;
+        size_t count;
+        char *ptr;
+        size_t result; // bytes read: 0 if the read failed.
+    };
+    // Carry out a batch of reads, setting the result of each. Readers that
+    // can do this more cheaply than with a read for each request override it.
+    virtual void readBatch(Request *requests, size_t count) const;
+
     // describe this reader.
     virtual void describe(std::ostream &os) const = 0;
 
@@ -122,6 +139,11 @@ public:
     // read a text string at an offset
     virtual std::string readString(off_t offset) const;
 
+    // If the reader has the "count" bytes at "off" in memory already, return
+    // a pointer to them, otherwise, return null. The pointer is valid for the
+    // lifetime of the reader.
+    virtual const char *view(off_t, size_t) const { return nullptr; }
+
     virtual off_t size() const = 0;
     typedef std::shared_ptr<Reader> sptr;
     typedef std::shared_ptr<const Reader> csptr;
@@ -176,6 +198,9 @@ public:
     MmapReader(const std::string &name_);
     ~MmapReader();
     std::string readString(off_t offset) const override;
+    const char *view(off_t off, size_t count) const override {
+        return off >= 0 && size_t(off) <= len && count <= len - off ? (char *)base + off : nullptr;
+    }
     void describe(std::ostream &os) const  override { os << name; }
     std::string filename() const override { return name; }
     off_t size() const override { return len; }
@@ -190,28 +215,42 @@ class CacheReader : public Reader {
     };
     Reader::csptr upstream;
     mutable std::unordered_map<off_t, CacheEnt> stringCache;
-    static const size_t PAGESIZE = 256;
-    static const size_t MAXPAGES = 16;
     class Page {
         Page(const Page &) = delete;
     public:
         off_t offset;
         size_t len;
-        char data[PAGESIZE];
-        Page() {};
-        void load(const Reader &r, off_t offset_);
+        std::unique_ptr<char[]> data;
+        Page(size_t pageSize) : offset(-1), len(0), data(new char[pageSize]) {}
+        void load(const Reader &r, off_t offset_, size_t pageSize);
     };
-    mutable std::list<Page *> pages;
-    Page *getPage(off_t pageoff) const;
+    // Pages are kept in most-recently-used order, and indexed by offset.
+    mutable std::list<Page> pages;
+    mutable std::unordered_map<off_t, std::list<Page>::iterator> pageIndex;
+    size_t pageSize;
+    size_t maxPages;
+    mutable unsigned long hits;
+    mutable unsigned long misses;
+    // Serialises access to the cache state above, so a CacheReader can be
+    // shared by concurrent readers.
+    mutable std::mutex lock;
+    Page &newPage(off_t pageoff) const;
+    const Page &getPage(off_t pageoff) const;
+    size_t readCached(off_t off, size_t count, char *ptr) const;
 public:
     void flush();
     virtual size_t read(off_t off, size_t count, char *ptr) const override;
+    void readBatch(Request *requests, size_t count) const override;
     virtual void describe(std::ostream &os) const override {
         // this must be the same as the underlying stream: we sometimes rely on the
         // FileReader's filename
         os << *upstream;
     }
-    CacheReader(Reader::csptr upstream_);
+    // Defaults for page size and number of pages for new CacheReaders.
+    static size_t defaultPageSize;
+    static size_t defaultMaxPages;
+    CacheReader(Reader::csptr upstream_, size_t pageSize_ = defaultPageSize,
+                size_t maxPages_ = defaultMaxPages);
     std::string readString(off_t off) const override;
     ~CacheReader();
     off_t size() const override { return upstream->size(); }
@@ -226,6 +265,9 @@ protected:
 public:
     virtual size_t read(off_t off, size_t count, char *ptr) const override;
     MemReader(const std::string &, size_t, const char *);
+    const char *view(off_t off, size_t count) const override {
+        return off >= 0 && size_t(off) <= len && count <= len - off ? data + off : nullptr;
+    }
     void describe(std::ostream &) const override;
     off_t size() const override { return len; }
     std::string filename() const override { return "in-memory"; }
@@ -252,6 +294,10 @@ public:
         return upstream->readString(absoff + offset);
     }
     virtual size_t read(off_t off, size_t count, char *ptr) const override;
+    const char *view(off_t off, size_t count) const override {
+        return off >= 0 && off <= length && count <= size_t(length - off)
+            ? upstream->view(off + offset, count) : nullptr;
+    }
     OffsetReader(Reader::csptr upstream_, off_t offset_, off_t length_ =
                  std::numeric_limits<off_t>::max());
     void describe(std::ostream &os) const override {
@@ -316,5 +362,160 @@ template <typename T> T ReaderArray<T>::iterator::operator *() {
    return t;
 }
 
+/*
+ * A map from keys to values that are expensive to make, such as parsed
+ * images, that's safe for concurrent use. Keys are spread over shards, each
+ * with its own lock, so lookups of different keys rarely contend, and no
+ * lock is held while making a value. Only one thread makes the value for a
+ * key: others that want it meanwhile wait for that thread's result, rather
+ * than making it again. Failures are passed to the waiting threads, but not
+ * cached.
+ */
+template <typename Key, typename Value>
+class ConcurrentCache {
+    struct Entry {
+        std::shared_future<Value> value;
+        std::thread::id maker;
+        bool ready() const {
+            return value.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+    };
+    struct Shard {
+        std::mutex lock;
+        std::map<Key, Entry> entries;
+    };
+    static const size_t shardCount = 16;
+    Shard shards[shardCount];
+    Shard &shardFor(const Key &key) { return shards[std::hash<Key>()(key) % shardCount]; }
+public:
+    // Get the value for "key", calling "make" to create it if we don't have
+    // it. "hit" is set if we had it, or another thread was making it.
+    template <typename Make> Value get(const Key &key, Make make, bool *hit = nullptr);
+    // The value for "key" if we have it, or Value() if we don't, or making
+    // it failed.
+    Value find(const Key &key);
+    void erase(const Key &key);
+    // Erase all entries with this value.
+    void eraseValue(const Value &value);
+    // Call "f" with each key and value made so far.
+    template <typename F> void forEach(F f);
+};
+
+template <typename Key, typename Value>
+template <typename Make>
+Value
+ConcurrentCache<Key, Value>::get(const Key &key, Make make, bool *hit)
+{
+    auto &shard = shardFor(key);
+    std::promise<Value> promise;
+    {
+        std::unique_lock<std::mutex> guard(shard.lock);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            // Making a value might look up others, but it can't wait for itself.
+            if (it->second.maker == std::this_thread::get_id() && !it->second.ready())
+                throw (Exception() << "recursive lookup in cache");
+            auto value = it->second.value;
+            guard.unlock();
+            if (hit)
+                *hit = true;
+            return value.get();
+        }
+        shard.entries.emplace(key, Entry { promise.get_future().share(), std::this_thread::get_id() });
+    }
+    if (hit)
+        *hit = false;
+    try {
+        Value value = make();
+        promise.set_value(value);
+        return value;
+    }
+    catch (...) {
+        promise.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.entries.erase(key);
+        throw;
+    }
+}
+
+template <typename Key, typename Value>
+Value
+ConcurrentCache<Key, Value>::find(const Key &key)
+{
+    auto &shard = shardFor(key);
+    std::shared_future<Value> value;
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end() ||
+              (it->second.maker == std::this_thread::get_id() && !it->second.ready()))
+            return Value();
+        value = it->second.value;
+    }
+    try {
+        return value.get();
+    }
+    catch (...) {
+        return Value();
+    }
+}
+
+template <typename Key, typename Value>
+void
+ConcurrentCache<Key, Value>::erase(const Key &key)
+{
+    auto &shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.entries.find(key);
+    // Leave values being made to their maker.
+    if (it != shard.entries.end() && it->second.ready())
+        shard.entries.erase(it);
+}
+
+template <typename Key, typename Value>
+void
+ConcurrentCache<Key, Value>::eraseValue(const Value &value)
+{
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for (auto it = shard.entries.begin(); it != shard.entries.end(); ) {
+            if (it->second.ready()) {
+                try {
+                    if (it->second.value.get() == value) {
+                        it = shard.entries.erase(it);
+                        continue;
+                    }
+                }
+                catch (...) {
+                    // failed: the maker will remove it.
+                }
+            }
+            ++it;
+        }
+    }
+}
+
+template <typename Key, typename Value>
+template <typename F>
+void
+ConcurrentCache<Key, Value>::forEach(F f)
+{
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for (const auto &entry : shard.entries) {
+            if (!entry.second.ready())
+                continue;
+            Value value;
+            try {
+                value = entry.second.value.get();
+            }
+            catch (...) {
+                continue; // failed: the maker will remove it.
+            }
+            f(entry.first, value);
+        }
+    }
+}
+
 
 #endif // LIBPSTACK_UTIL_H
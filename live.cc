@@ -3,6 +3,7 @@
 
 #include <sys/ptrace.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <dirent.h>
 #include <err.h>
@@ -10,8 +11,11 @@
 #include <unistd.h>
 #include <wait.h>
 
+#include <algorithm>
 #include <climits>
+#include <fstream>
 #include <iostream>
+#include <set>
 #include <utility>
 
 std::string
@@ -23,13 +27,110 @@ procname(pid_t pid, const std::string &base)
 LiveReader::LiveReader(pid_t pid, const std::string &base)
    : FileReader(procname(pid, base)) {}
 
+bool ProcessVMReader::enabled = true;
+
+ProcessVMReader::ProcessVMReader(pid_t pid_)
+    : pid(pid_)
+    , procMem(pid_, "mem")
+    , useProcMem(!enabled)
+    , requests(0)
+    , syscalls(0)
+{
+}
+
+ProcessVMReader::~ProcessVMReader()
+{
+    if (verbose >= 2 && requests != 0)
+        *debug << "memory reader for " << procMem << ": " << requests
+            << " requests in " << syscalls << " "
+            << (useProcMem ? "pread" : "process_vm_readv") << " calls" << std::endl;
+}
+
+/*
+ * Decide if an error from process_vm_readv means we should read
+ * /proc/<pid>/mem instead from now on.
+ */
+bool
+ProcessVMReader::fallback(int err) const
+{
+    if (err != ENOSYS && err != EPERM)
+        return false;
+    if (verbose > 0)
+        *debug << "can't use process_vm_readv for " << procMem << ": "
+            << strerror(err) << ": reading " << procMem << " instead\n";
+    useProcMem = true;
+    return true;
+}
+
+size_t
+ProcessVMReader::read(off_t off, size_t count, char *ptr) const
+{
+    requests++;
+    syscalls++;
+    if (!useProcMem) {
+        iovec local { ptr, count };
+        iovec remote { (void *)off, count };
+        auto rc = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        if (rc != -1)
+            return rc;
+        if (!fallback(errno))
+            throw (Exception() << "read " << count << " at " << off << " on " << *this
+                << " failed: " << strerror(errno));
+    }
+    return procMem.read(off, count, ptr);
+}
+
+void
+ProcessVMReader::readBatch(Request *batch, size_t count) const
+{
+    if (useProcMem) {
+        Reader::readBatch(batch, count);
+        return;
+    }
+    requests += count;
+    std::vector<iovec> local, remote;
+    for (size_t start = 0; start < count; ) {
+        // process_vm_readv stops at the first region it can't read fully: we
+        // then carry on from the region after that.
+        size_t end = std::min(count, start + IOV_MAX);
+        local.clear();
+        remote.clear();
+        for (size_t i = start; i < end; ++i) {
+            local.push_back(iovec { batch[i].ptr, batch[i].count });
+            remote.push_back(iovec { (void *)batch[i].offset, batch[i].count });
+            batch[i].result = 0;
+        }
+        syscalls++;
+        auto rc = process_vm_readv(pid, local.data(), local.size(), remote.data(), remote.size(), 0);
+        if (rc == -1) {
+            if (fallback(errno)) {
+                requests -= count - start; // counted again by read.
+                Reader::readBatch(batch + start, count - start);
+                return;
+            }
+            start++; // can't read any of the first region.
+            continue;
+        }
+        size_t got = rc;
+        for (; start < end; ++start) {
+            batch[start].result = std::min(got, batch[start].count);
+            got -= batch[start].result;
+            if (batch[start].result != batch[start].count) {
+                start++;
+                break;
+            }
+        }
+    }
+}
+
 LiveProcess::LiveProcess(Elf::Object::sptr &ex, pid_t pid_,
             const PathReplacementList &repls, Dwarf::ImageCache &imageCache)
     : Process(
             ex ? ex : imageCache.getImageForName(procname(pid_, "exe")),
-            std::make_shared<CacheReader>(std::make_shared<LiveReader>(pid_, "mem")),
+            std::make_shared<CacheReader>(std::make_shared<ProcessVMReader>(pid_)),
             repls, imageCache)
     , pid(pid_)
+    , memCache(std::static_pointer_cast<CacheReader>(io))
 {
     (void)ps_getpid(this);
 }
@@ -59,12 +160,37 @@ LiveProcess::getRegs(lwpid_t pid, Elf::CoreRegisters *reg)
     iovec iov;
     iov.iov_base = reg;
     iov.iov_len = sizeof *reg;
-    int rc= ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iov) != -1;
+    int rc = ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iov);
     resume(pid);
-    return rc == 0;
+    return rc != -1;
 #endif
 }
 
+bool
+LiveProcess::findMapping(Elf::Addr addr, Elf::Addr *start, Elf::Addr *end) const
+{
+    if (mappings.empty()) {
+        std::ifstream maps(procname(pid, "maps"));
+        std::string line;
+        while (std::getline(maps, line)) {
+            // Lines start "<start>-<end> ...", in hex, in ascending order.
+            char *p;
+            Elf::Addr low = strtoull(line.c_str(), &p, 16);
+            if (*p != '-')
+                continue;
+            mappings.emplace_back(low, strtoull(p + 1, nullptr, 16));
+        }
+    }
+    auto it = std::upper_bound(mappings.begin(), mappings.end(), addr,
+            [] (Elf::Addr addr, const std::pair<Elf::Addr, Elf::Addr> &mapping)
+            { return addr < mapping.first; });
+    if (it == mappings.begin() || addr >= (--it)->second)
+        return false;
+    *start = it->first;
+    *end = it->second;
+    return true;
+}
+
 void
 LiveProcess::resume(lwpid_t pid)
 {
@@ -75,7 +201,7 @@ LiveProcess::resume(lwpid_t pid)
     kill(pid, SIGCONT);
     if (ptrace(PT_DETACH, pid, caddr_t(1), 0) != 0)
         std::clog << "failed to detach from process " << pid << ": " << strerror(errno) << "\n";
-    dynamic_cast<CacheReader&>(*io).flush();
+    memCache->flush();
     if (verbose >= 1) {
         timeval tv;
         gettimeofday(&tv, nullptr);
@@ -94,13 +220,24 @@ LiveProcess::findLWPs()
     DIR *d = opendir(dirName.c_str());
     dirent *de;
     if (d != nullptr) {
+        std::set<lwpid_t> present;
         while ((de = readdir(d)) != nullptr) {
             char *p;
             lwpid_t pid = strtol(de->d_name, &p, 0);
-            if (*p == 0)
+            if (*p == 0) {
                 (void)lwps[pid];
+                present.insert(pid);
+            }
         }
         closedir(d);
+        // Forget LWPs that have exited since we last looked, so we don't
+        // try to stop them again.
+        for (auto it = lwps.begin(); it != lwps.end(); ) {
+            if (it->second.stopCount == 0 && present.find(it->first) == present.end())
+                it = lwps.erase(it);
+            else
+                ++it;
+        }
     }
 }
 
@@ -113,6 +250,7 @@ LiveProcess::getPID() const
 void
 LiveProcess::stopProcess()
 {
+    gettimeofday(&processStoppedAt, nullptr);
     stop(pid); // suspend the main process itself first.
     findLWPs();
 
@@ -156,6 +294,12 @@ LiveProcess::resumeProcess()
         resume(lwp.first);
 
     resume(pid);
+    mappings.clear(); // they may change now it's running again.
+
+    timeval tv;
+    gettimeofday(&tv, nullptr);
+    lastStopDuration = (tv.tv_sec - processStoppedAt.tv_sec) * 1000000
+        + tv.tv_usec - processStoppedAt.tv_usec;
 }
 
 void
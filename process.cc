@@ -29,6 +29,7 @@ Process::Process(Elf::Object::sptr exec, Reader::sptr memory,
     , execImage(std::move(exec))
     , pathReplacements(prl)
     , sysent(0)
+    , lastStopDuration(-1)
     , imageCache(cache)
     , io(std::move(memory))
 {
@@ -113,18 +114,22 @@ Process::processAUXV(const Reader &auxio)
             }
             case AT_SYSINFO_EHDR: {
                 try {
-                    struct VDSOReader : public OffsetReader {
-                        void describe(std::ostream &os) const override {
-                            os << "(vdso image)";
-                        }
-                        VDSOReader( Reader::csptr up, off_t start, off_t length) :
-                            OffsetReader(std::move(up), start, length) {}
-                    };
-                    auto elf = std::make_shared<Elf::Object>(imageCache,
-                                    std::make_shared<VDSOReader>(io, hdr, 65536));
+                    // Copy the VDSO out of the process, so the image cache
+                    // can share it with other processes with the same one.
+                    // Its section headers are normally last, but allow for
+                    // segments after them.
+                    auto ehdr = io->readObj<Elf::Ehdr>(hdr);
+                    size_t size = std::max(ehdr.e_shoff + ehdr.e_shnum * ehdr.e_shentsize,
+                          ehdr.e_phoff + ehdr.e_phnum * ehdr.e_phentsize);
+                    std::vector<Elf::Phdr> phdrs(ehdr.e_phnum);
+                    io->readObj(hdr + ehdr.e_phoff, phdrs.data(), phdrs.size());
+                    for (const auto &phdr : phdrs)
+                        size = std::max(size, size_t(phdr.p_offset + phdr.p_filesz));
+                    std::string content(std::min(size, size_t(65536)), '\0');
+                    io->readObj(hdr, &content[0], content.size());
+                    auto elf = imageCache.getVDSO(std::move(content));
                     vdsoBase = hdr;
                     addElfObject(elf, hdr);
-                    vdsoImage = elf;
                     if (verbose >= 2) {
                         *debug << "auxv: VDSO " << *elf->io
                            << " loaded at " << std::hex << hdr << "\n";
@@ -216,10 +221,11 @@ struct PrintableFrame {
     const PstackOptions &options;
     Elf::Addr functionOffset;
     bool haveSym;
-    Dwarf::StackFrame *frame;
+    const Dwarf::StackFrame *frame;
     std::vector<Dwarf::DIE> inlined; // func + inlined.
+    std::vector<std::string> inlinedNames;
 
-    PrintableFrame(Dwarf::StackFrame *frame, int frameNo, const PstackOptions &options)
+    PrintableFrame(const Process &p, const Dwarf::StackFrame *frame, int frameNo, const PstackOptions &options)
         : frameNumber(frameNo)
         , isSignalFrame(frame->cie != nullptr && frame->cie->isSignalHandler)
         , options(options)
@@ -229,35 +235,18 @@ struct PrintableFrame {
     {
         if (frame->elf == nullptr)
             return;
-        Elf::Addr objIp = frame->scopeIP() - frame->elfReloc;
-        Dwarf::Unit::sptr u = frame->dwarf->lookupUnit(objIp);
-        if (u) {
-            Dwarf::DIE function = Dwarf::findEntryForAddr(objIp, Dwarf::DW_TAG_subprogram, u->root());
-            if (function) {
-                frame->function = function;
-                std::ostringstream sos;
-                ::dieName(sos, function);
-                this->dieName = sos.str();
-                auto lowpc = function.attribute(Dwarf::DW_AT_low_pc);
-                if (lowpc.valid())
-                    functionOffset = objIp - uintmax_t(lowpc);
-                while (function) {
-                   auto inl = Dwarf::findEntryForAddr(objIp, Dwarf::DW_TAG_inlined_subroutine, function);
-                   if (!inl)
-                      break;
-                   inlined.push_back(inl);
-                   function = inl;
-                }
-            }
-        }
-
+        const auto &syms = p.frameSymbols(frame->scopeIP(), frame->elf, frame->dwarf,
+              frame->elfReloc, !options[PstackOption::nosrc]);
+        frame->function = syms.function;
+        dieName = syms.dieName;
+        inlined = syms.inlined;
+        inlinedNames = syms.inlinedNames;
+        symbol = syms.symbol;
+        symName = syms.symName;
+        haveSym = syms.haveSym;
+        functionOffset = syms.functionOffset;
         if (!options[PstackOption::nosrc])
-            source = frame->dwarf->sourceFromAddr(objIp);
-
-        haveSym = frame->elf->findSymbolByAddress(objIp, STT_FUNC, symbol, symName);
-        if (haveSym && functionOffset == std::numeric_limits<Elf::Addr>::max())
-            functionOffset = objIp - symbol.st_value;
-
+            source = syms.source;
     }
     PrintableFrame(const PrintableFrame &) = delete;
     PrintableFrame() = delete;
@@ -286,12 +275,12 @@ operator << (std::ostream &os, const JSON<std::pair<Elf::Sym *, std::string>> &j
 }
 
 std::ostream &
-operator << (std::ostream &os, const JSON<Dwarf::StackFrame *, Process *> &jt)
+operator << (std::ostream &os, const JSON<Dwarf::StackFrame, Process *> &jt)
 {
-    auto &frame =jt.object;
+    auto frame = &jt.object;
     PstackOptions options;
     options[doargs] = true;
-    PrintableFrame pframe(frame, 0, options);
+    PrintableFrame pframe(*jt.context, frame, 0, options);
 
     JObject jo(os);
     jo
@@ -553,20 +542,21 @@ Process::dumpStackText(std::ostream &os, const ThreadStack &thread,
     os << "thread: " << (void *)thread.info.ti_tid << ", lwp: "
        << thread.info.ti_lid << ", type: " << thread.info.ti_type << "\n";
     int frameNo = 0;
-    for (auto frame : thread.stack)
-        dumpFrameText(os, PrintableFrame(frame, frameNo++, options), frame);
+    for (const auto &frame : thread.stack)
+        dumpFrameText(os, PrintableFrame(*this, &frame, frameNo++, options), &frame);
     return os;
 }
 
 std::ostream &
 Process::dumpFrameText(std::ostream &os, const PrintableFrame &pframe,
-        Dwarf::StackFrame *frame) const
+        const Dwarf::StackFrame *frame) const
 {
 
     IOFlagSave _(os);
 
     std::pair<std::string, int> src = pframe.source.size() ? pframe.source[0] : std::make_pair( "", std::numeric_limits<Elf::Addr>::max());
-    for (auto i = pframe.inlined.rbegin(); i != pframe.inlined.rend(); ++i) {
+    for (size_t idx = pframe.inlined.size(); idx-- != 0; ) {
+       auto i = &pframe.inlined[idx];
        os << "#"
            << std::left << std::setw(2) << std::setfill(' ') << pframe.frameNumber << " "
            << std::setw(ELF_BITS/4 + 2) << std::setfill(' ')
@@ -575,8 +565,7 @@ Process::dumpFrameText(std::ostream &os, const PrintableFrame &pframe,
            os << std::setw(ELF_BITS/4 + 2) << std::setfill(' ') << "/";
            os << " ";
        }
-       os << " in ";
-       ::dieName(os, *i);
+       os << " in " << pframe.inlinedNames[idx];
        auto lineinfo = i->getUnit()->getLines();
        if (lineinfo) {
           os << " at " << src.first << ":" << src.second;
@@ -630,6 +619,87 @@ Process::dumpFrameText(std::ostream &os, const PrintableFrame &pframe,
     return os;
 }
 
+FrameSymbols::FrameSymbols()
+    : symbol()
+    , haveSym(false)
+    , functionOffset(std::numeric_limits<Elf::Addr>::max())
+    , sourceResolved(false)
+{
+}
+
+const FrameSymbols &
+Process::frameSymbols(Elf::Addr addr, const Elf::Object::sptr &elf,
+      const Dwarf::Info::sptr &dwarf, Elf::Addr reloc, bool withSource) const
+{
+    Elf::Addr objIp = addr - reloc;
+    auto it = symbolCache.find(addr);
+    if (it == symbolCache.end()) {
+        // Resolve into a temporary, so a failed lookup isn't cached.
+        FrameSymbols syms;
+        if (dwarf) {
+            auto functions = dwarf->functionsForAddr(objIp);
+            if (!functions.empty()) {
+                syms.function = functions.front();
+                std::ostringstream sos;
+                ::dieName(sos, syms.function);
+                syms.dieName = sos.str();
+                auto lowpc = syms.function.attribute(Dwarf::DW_AT_low_pc);
+                if (lowpc.valid())
+                    syms.functionOffset = objIp - uintmax_t(lowpc);
+                syms.inlined.assign(functions.begin() + 1, functions.end());
+                for (const auto &die : syms.inlined) {
+                    std::ostringstream ios;
+                    ::dieName(ios, die);
+                    syms.inlinedNames.push_back(ios.str());
+                }
+            }
+        }
+        syms.haveSym = elf->findSymbolByAddress(objIp, STT_FUNC, syms.symbol, syms.symName);
+        if (syms.haveSym && syms.functionOffset == std::numeric_limits<Elf::Addr>::max())
+            syms.functionOffset = objIp - syms.symbol.st_value;
+        it = symbolCache.emplace(addr, std::move(syms)).first;
+    }
+    auto &syms = it->second;
+    if (withSource && !syms.sourceResolved && dwarf) {
+        syms.source = dwarf->sourceFromAddr(objIp);
+        syms.sourceResolved = true;
+    }
+    return syms;
+}
+
+std::vector<std::string>
+Process::functionNames(Elf::Addr addr)
+{
+    std::vector<std::string> names;
+    Elf::Addr reloc;
+    Elf::Object::sptr obj;
+    const Elf::Phdr *segment;
+    std::tie(reloc, obj, segment) = findSegment(addr);
+    if (obj) {
+        try {
+            const auto &syms = frameSymbols(addr, obj, getDwarf(obj), reloc, false);
+            if (syms.dieName != "") {
+                names.push_back(syms.dieName);
+                names.insert(names.end(), syms.inlinedNames.begin(), syms.inlinedNames.end());
+            } else if (syms.haveSym) {
+                names.push_back(syms.symName);
+            }
+        }
+        catch (const std::exception &ex) {
+            if (verbose > 0)
+                *debug << "can't find function for " << std::hex << addr << std::dec
+                    << " in " << *obj->io << ": " << ex.what() << "\n";
+            Elf::Sym symbol;
+            std::string symName;
+            if (obj->findSymbolByAddress(addr - reloc, STT_FUNC, symbol, symName))
+                names.push_back(symName);
+        }
+    }
+    if (names.empty())
+        names.push_back("<unknown>");
+    return names;
+}
+
 void
 Process::addElfObject(Elf::Object::sptr obj, Elf::Addr load)
 {
@@ -784,35 +854,125 @@ Process::findSymbol(const char *name, bool includeDebug,
 
 Process::~Process()
 {
-    // don't leave the VDSO in the cache - a new copy will be entered for a new
-    // process.
-    imageCache.flush(vdsoImage);
     td_ta_delete(agent);
 }
 
+void
+SnapshotReader::capture(const std::vector<std::pair<Elf::Addr, size_t>> &regions)
+{
+    // Read all the regions in a single batch.
+    std::vector<std::vector<char>> data(regions.size());
+    std::vector<Request> requests;
+    requests.reserve(regions.size());
+    for (size_t i = 0; i < regions.size(); ++i) {
+        data[i].resize(regions[i].second);
+        requests.push_back(Request { off_t(regions[i].first), regions[i].second, data[i].data(), 0 });
+    }
+    upstream->readBatch(requests.data(), requests.size());
+    for (size_t i = 0; i < regions.size(); ++i) {
+        // Leave reads of anything we failed to copy to the upstream reader.
+        if (requests[i].result == 0) {
+            if (verbose > 0)
+                *debug << "can't capture " << regions[i].second << " bytes at "
+                    << std::hex << regions[i].first << std::dec << " from " << *upstream << "\n";
+            continue;
+        }
+        data[i].resize(requests[i].result);
+        captures[regions[i].first] = std::move(data[i]);
+    }
+}
+
+size_t
+SnapshotReader::read(off_t off, size_t count, char *ptr) const
+{
+    size_t total = 0;
+    while (count != 0) {
+        // Find the last capture starting at or before off.
+        auto it = captures.upper_bound(off);
+        if (it != captures.begin()) {
+            --it;
+            size_t skip = off - it->first;
+            if (skip < it->second.size()) {
+                size_t chunk = std::min(count, it->second.size() - skip);
+                memcpy(ptr, it->second.data() + skip, chunk);
+                off += chunk;
+                ptr += chunk;
+                count -= chunk;
+                total += chunk;
+                continue;
+            }
+        }
+        // Not captured: read from upstream, up to the start of the next capture.
+        auto next = captures.upper_bound(off);
+        size_t chunk = next == captures.end() ? count : std::min(count, size_t(next->first - off));
+        size_t got = upstream->read(off, chunk, ptr);
+        total += got;
+        if (got != chunk)
+            break;
+        off += chunk;
+        ptr += chunk;
+        count -= chunk;
+    }
+    return total;
+}
+
+void
+SnapshotReader::readBatch(Request *requests, size_t count) const
+{
+    // Satisfy what we can from the captures, and pass the rest upstream.
+    std::vector<Request> upstreamRequests;
+    std::vector<Request *> forwarded;
+    for (size_t i = 0; i < count; ++i) {
+        auto &req = requests[i];
+        auto next = captures.upper_bound(req.offset);
+        if (next != captures.begin()) {
+            auto it = std::prev(next);
+            size_t skip = req.offset - it->first;
+            if (skip < it->second.size()) {
+                if (req.count <= it->second.size() - skip) {
+                    memcpy(req.ptr, it->second.data() + skip, req.count);
+                    req.result = req.count;
+                } else {
+                    // Partly captured: let read sort it out.
+                    Reader::readBatch(&req, 1);
+                }
+                continue;
+            }
+        }
+        if (next != captures.end() && next->first < Elf::Addr(req.offset + req.count)) {
+            Reader::readBatch(&req, 1);
+            continue;
+        }
+        upstreamRequests.push_back(req);
+        forwarded.push_back(&req);
+    }
+    if (upstreamRequests.empty())
+        return;
+    upstream->readBatch(upstreamRequests.data(), upstreamRequests.size());
+    for (size_t i = 0; i < forwarded.size(); ++i)
+        forwarded[i]->result = upstreamRequests[i].result;
+}
+
 void
 ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
 {
     stack.clear();
     try {
-        auto curFrame = new Dwarf::StackFrame(Dwarf::UnwindMechanism::MACHINEREGS);
-        auto startFrame = curFrame;
-        const Dwarf::StackFrame *prevFrame = 0;
-
         // Set up the first frame using the machine context registers
-        startFrame->setCoreRegs(regs);
-
-        Dwarf::StackFrame *nextFrame;
-        for (size_t frameCount = 0; frameCount < gMaxFrames; frameCount++,
-              prevFrame = curFrame, curFrame = nextFrame) {
-            if (curFrame == 0)
-               break;
-            stack.push_back(curFrame);
-            nextFrame = 0;
+        stack.emplace_back(Dwarf::UnwindMechanism::MACHINEREGS);
+        stack.back().setCoreRegs(regs);
+
+        // Frames are added to the end of "stack", which may move them, so we
+        // refer to the current and previous frame by index.
+        for (size_t cur = 0; stack.size() < gMaxFrames; cur++) {
+            Dwarf::StackFrame nextFrame(Dwarf::UnwindMechanism::DWARF);
             try {
-               nextFrame = curFrame->unwind(p);
+               if (!stack[cur].unwind(p, nextFrame))
+                   break;
+               stack.push_back(nextFrame);
             }
             catch (const std::exception &ex) {
+                const Dwarf::StackFrame &curFrame = stack[cur];
 
                 if (verbose > 2)
                     *debug << "failed to unwind frame with DWARF: "
@@ -837,19 +997,20 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
                 // runtime-generated code, or something else that wasn't in a
                 // normal ELF phdr, so it seems more likely this is the best
                 // thing to do.
-                if ((curFrame == startFrame ||
-                         (prevFrame->cie && prevFrame->cie->isSignalHandler)) &&
-                   (curFrame->phdr == 0 || (curFrame->phdr->p_flags & PF_X) == 0)) {
-                    nextFrame = new Dwarf::StackFrame(*curFrame,
+                if ((cur == 0 ||
+                         (stack[cur - 1].cie && stack[cur - 1].cie->isSignalHandler)) &&
+                   (curFrame.phdr == 0 || (curFrame.phdr->p_flags & PF_X) == 0)) {
+                    Dwarf::StackFrame badIpFrame(curFrame,
                           Dwarf::UnwindMechanism::BAD_IP_RECOVERY);
                     // get stack pointer in the current frame, and read content of
                     // TOS
-                    auto sp = curFrame->getReg(SPREG);
+                    auto sp = curFrame.getReg(SPREG);
                     Elf::Addr ip;
                     auto in = p.io->read(sp, sizeof ip, (char *)&ip);
                     if (in == sizeof ip) {
-                        nextFrame->setReg(SPREG, sp + sizeof ip); // pop...
-                        nextFrame->setReg(IPREG, ip);             // .. insn pointer.
+                        badIpFrame.setReg(SPREG, sp + sizeof ip); // pop...
+                        badIpFrame.setReg(IPREG, ip);             // .. insn pointer.
+                        stack.push_back(badIpFrame);
                         continue;
                     }
                 }
@@ -860,17 +1021,17 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
                 Elf::Addr reloc;
                 const Elf::Phdr *segment;
                 Elf::Object::sptr obj;
-                std::tie(reloc, obj, segment) = p.findSegment(curFrame->rawIP());
+                std::tie(reloc, obj, segment) = p.findSegment(curFrame.rawIP());
                 if (obj) {
                     Elf::Addr sigContextAddr = 0;
-                    auto objip = curFrame->rawIP() - reloc;
+                    auto objip = curFrame.rawIP() - reloc;
                     auto restoreSym = obj->findDebugSymbol("__restore");
                     if (restoreSym && objip == restoreSym.symbol.st_value)
-                        sigContextAddr = curFrame->getReg(SPREG) + 4;
+                        sigContextAddr = curFrame.getReg(SPREG) + 4;
                     else {
                         auto restoreRtSym = obj->findDebugSymbol("__restore_rt");
                         if (restoreRtSym && objip == restoreRtSym.symbol.st_value)
-                            sigContextAddr = p.io->readObj<Elf::Addr>(curFrame->getReg(SPREG) + 8) + 20;
+                            sigContextAddr = p.io->readObj<Elf::Addr>(curFrame.getReg(SPREG) + 8) + 20;
                     }
                     if (sigContextAddr != 0) {
                        // This mapping is based on DWARF regnos, and ucontext.h
@@ -895,10 +1056,11 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
                            { 14, REG_FS }
                        };
                        p.io->readObj(sigContextAddr, &regs);
-                       nextFrame = new Dwarf::StackFrame(*curFrame,
+                       Dwarf::StackFrame trampolineFrame(curFrame,
                              Dwarf::UnwindMechanism::TRAMPOLINE);
                        for (auto &reg : gregmap)
-                           nextFrame->setReg(reg.dwarf, regs[reg.greg]);
+                           trampolineFrame.setReg(reg.dwarf, regs[reg.greg]);
+                       stack.push_back(trampolineFrame);
                        continue;
                     }
                 }
@@ -909,17 +1071,18 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs)
                 // Use ebp/rbp to find return address and saved BP.
                 // Restore those, and the stack pointer itself.
                 Elf::Addr newBp, newIp, oldBp;
-                oldBp = curFrame->getReg(BPREG);
+                oldBp = curFrame.getReg(BPREG);
                 if (oldBp == 0)
                    return; // null base pointer means we're done.
                 p.io->readObj(oldBp + ELF_BYTES, &newIp);
                 p.io->readObj(oldBp, &newBp);
                 if (newBp > oldBp && newIp > 4096) {
-                    nextFrame = new Dwarf::StackFrame(*curFrame,
+                    Dwarf::StackFrame fpFrame(curFrame,
                           Dwarf::UnwindMechanism::FRAMEPOINTER);
-                    nextFrame->setReg(SPREG, oldBp + ELF_BYTES * 2);
-                    nextFrame->setReg(BPREG, newBp);
-                    nextFrame->setReg(IPREG, newIp);
+                    fpFrame.setReg(SPREG, oldBp + ELF_BYTES * 2);
+                    fpFrame.setReg(BPREG, newBp);
+                    fpFrame.setReg(IPREG, newIp);
+                    stack.push_back(fpFrame);
                     continue;
                 }
 #endif
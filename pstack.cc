@@ -1,4 +1,7 @@
+#define REGMAP(a,b)
+#include "libpstack/dwarf/archreg.h"
 #include "libpstack/dwarf.h"
+#include "libpstack/indexcache.h"
 #include "libpstack/proc.h"
 #include "libpstack/ps_callback.h"
 #if defined(WITH_PYTHON2) || defined(WITH_PYTHON3)
@@ -9,13 +12,23 @@
 #include <sys/types.h>
 #include <sys/signal.h>
 
+#include <dirent.h>
 #include <sysexits.h>
 #include <unistd.h>
 
 #include <csignal>
+#include <cstring>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
 
 #define XSTR(a) #a
 #define STR(a) XSTR(a)
@@ -24,17 +37,103 @@ extern std::ostream & operator << (std::ostream &os, const JSON<ThreadStack, Pro
 namespace {
 bool doJson = false;
 volatile bool interrupted = false;
+unsigned unwindThreads = 1; // number of threads to unwind stacks on after resuming
+
+/*
+ * If snapshotSize is non-zero, we copy this much of each thread's stack from
+ * its stack pointer up while the process is stopped (and a little below, for
+ * the red zone), staying within the stack's mapping. We then unwind the
+ * threads after the process resumes. Anything else the unwinder reads comes
+ * from the running process.
+ */
+size_t snapshotSize = 0;
+const size_t defaultSnapshotSize = 64 * 1024;
+const size_t redZoneSize = 128;
+
+// If sampleRate is non-zero, we sample stacks at that many times a second,
+// for sampleDuration seconds (or until interrupted, if that's zero).
+double sampleRate = 0;
+double sampleDuration = 0;
+
+// For fleet mode, the processes to examine, by name or cgroup, and how many
+// to examine at once.
+std::string fleetName;
+std::string fleetCgroup;
+unsigned fleetWorkers = std::max(std::thread::hardware_concurrency(), 1U);
+
+/*
+ * Unwind each thread from its saved registers, sharing the work among
+ * "threads" threads, including the caller.
+ */
+void
+unwindConcurrently(Process &proc,
+      std::vector<std::pair<ThreadStack *, Elf::CoreRegisters>> &work, unsigned threads)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&proc, &work, &next] () {
+        for (size_t i; (i = next++) < work.size(); )
+            work[i].first->unwind(proc, work[i].second);
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(size_t(threads), work.size()); ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+}
 
 int usage(const char *);
-std::ostream &
-pstack(Process &proc, std::ostream &os, const PstackOptions &options)
+
+/*
+ * Stop the process, and unwind the stack of each of its threads, either
+ * while it's stopped, or, if we're taking snapshots, after it resumes.
+ */
+void
+collectStacks(Process &proc, std::list<ThreadStack> &threadStacks)
 {
-    // get its back trace.
-    std::list<ThreadStack> threadStacks;
     std::set<pid_t> tracedLwps;
+
+    // For unwinding after resuming, the registers of each thread, and
+    // copies of their stacks.
+    std::vector<std::pair<ThreadStack *, Elf::CoreRegisters>> deferred;
+    std::vector<std::pair<Elf::Addr, size_t>> stackRegions;
+    std::shared_ptr<SnapshotReader> snapshot;
+    if (snapshotSize != 0) {
+        snapshot = std::make_shared<SnapshotReader>(proc.io);
+        // Load the unwind information for every object before stopping, so
+        // the threads don't have to, and the process is stopped for less time.
+        for (auto &obj : proc.objects) {
+            try {
+                proc.getDwarf(obj.second);
+            }
+            catch (const std::exception &ex) {
+                if (verbose > 0)
+                    *debug << "can't load DWARF for " << *obj.second->io << ": " << ex.what() << "\n";
+            }
+        }
+    }
+
+    auto addThread = [&proc, &deferred, &stackRegions, &snapshot] (ThreadStack &stack, Elf::CoreRegisters &regs) {
+        if (!snapshot) {
+            stack.unwind(proc, regs);
+            return;
+        }
+        Dwarf::StackFrame top(Dwarf::UnwindMechanism::MACHINEREGS);
+        top.setCoreRegs(regs);
+        Elf::Addr sp = top.getReg(SPREG);
+        Elf::Addr low = sp - redZoneSize, high = sp + snapshotSize;
+        Elf::Addr mapStart, mapEnd;
+        if (proc.findMapping(sp, &mapStart, &mapEnd)) {
+            low = std::max(low, mapStart);
+            high = std::min(high, mapEnd);
+        }
+        stackRegions.emplace_back(low, high - low);
+        deferred.emplace_back(&stack, regs);
+    };
+
     {
         StopProcess here(&proc);
-        proc.listThreads([&proc, &threadStacks, &tracedLwps] (const td_thrhandle_t *thr) {
+        proc.listThreads([&proc, &threadStacks, &tracedLwps, &addThread] (const td_thrhandle_t *thr) {
 
             Elf::CoreRegisters regs;
             td_err_e the;
@@ -46,7 +145,7 @@ pstack(Process &proc, std::ostream &os, const PstackOptions &options)
             if (the == TD_OK) {
                 threadStacks.push_back(ThreadStack());
                 td_thr_get_info(thr, &threadStacks.back().info);
-                threadStacks.back().unwind(proc, regs);
+                addThread(threadStacks.back(), regs);
                 tracedLwps.insert(threadStacks.back().info.ti_lid);
             }
 
@@ -54,23 +153,45 @@ pstack(Process &proc, std::ostream &os, const PstackOptions &options)
 
         for (auto &lwp : proc.lwps) {
             if (tracedLwps.find(lwp.first) == tracedLwps.end()) {
+                // Without its registers (say, the LWP has exited), we've
+                // nothing to unwind.
+                Elf::CoreRegisters regs;
+                if (!proc.getRegs(lwp.first,  &regs))
+                    continue;
                 threadStacks.push_back(ThreadStack());
                 threadStacks.back().info.ti_lid = lwp.first;
-                Elf::CoreRegisters regs;
-                proc.getRegs(lwp.first,  &regs);
-                threadStacks.back().unwind(proc, regs);
+                addThread(threadStacks.back(), regs);
             }
         }
+        if (snapshot)
+            snapshot->capture(stackRegions);
     }
 
-    /*
-     * resume at this point - maybe a bit optimistic if a shared library gets
-     * unloaded while we print stuff out, but worth the risk, normally.
-     */
+    if (snapshot) {
+        // The process is running again: unwind from the copies of the stacks.
+        auto liveIO = proc.io;
+        proc.io = snapshot;
+        try {
+            unwindConcurrently(proc, deferred, unwindThreads);
+        }
+        catch (...) {
+            proc.io = liveIO;
+            throw;
+        }
+        proc.io = liveIO;
+    }
+}
+
+std::ostream &
+printStacks(Process &proc, std::ostream &os, const std::list<ThreadStack> &threadStacks,
+      const PstackOptions &options)
+{
     if (doJson) {
         os << json(threadStacks, &proc);
     } else {
         os << "process: " << *proc.io << "\n";
+        if (proc.lastStopDuration >= 0)
+            os << "stopped for " << proc.lastStopDuration << " microseconds\n";
         for (auto &s : threadStacks) {
             proc.dumpStackText(os, s, options);
             os << std::endl;
@@ -79,6 +200,241 @@ pstack(Process &proc, std::ostream &os, const PstackOptions &options)
     return os;
 }
 
+std::ostream &
+pstack(Process &proc, std::ostream &os, const PstackOptions &options)
+{
+    // get its back trace.
+    std::list<ThreadStack> threadStacks;
+    collectStacks(proc, threadStacks);
+
+    /*
+     * resume at this point - maybe a bit optimistic if a shared library gets
+     * unloaded while we print stuff out, but worth the risk, normally.
+     */
+    return printStacks(proc, os, threadStacks, options);
+}
+
+/*
+ * Find the live processes for fleet mode: those whose command name (as in
+ * /proc/<pid>/comm) is "name", or those in the cgroup "cgroup". That's a
+ * path under /sys/fs/cgroup, as listed in /proc/<pid>/cgroup for cgroup v2,
+ * or the cgroup's directory, for v1 hierarchies.
+ */
+std::vector<pid_t>
+fleetPids(const std::string &name, const std::string &cgroup)
+{
+    std::vector<pid_t> pids;
+    if (cgroup != "") {
+        std::ifstream procs("/sys/fs/cgroup/" + cgroup + "/cgroup.procs");
+        if (!procs)
+            procs.open(cgroup + "/cgroup.procs");
+        if (!procs)
+            throw (Exception() << "can't read processes in cgroup " << cgroup);
+        for (pid_t pid; procs >> pid; )
+            if (pid != getpid()) // we can't stop and examine ourselves.
+                pids.push_back(pid);
+    } else {
+        std::unique_ptr<DIR, int (*)(DIR *)> proc(opendir("/proc"), closedir);
+        if (!proc)
+            throw (Exception() << "can't list processes: " << strerror(errno));
+        while (auto ent = readdir(proc.get())) {
+            char *end;
+            pid_t pid = strtol(ent->d_name, &end, 10);
+            if (*end != 0 || pid == 0 || pid == getpid())
+                continue;
+            std::ifstream comm(stringify("/proc/", pid, "/comm"));
+            std::string procName;
+            if (std::getline(comm, procName) && procName == name)
+                pids.push_back(pid);
+        }
+    }
+    std::sort(pids.begin(), pids.end());
+    return pids;
+}
+
+/*
+ * Print the stacks of the live processes "pids", examining up to "workers"
+ * of them at once, and sharing "imageCache" between them. Loading,
+ * stopping and unwinding each process runs in parallel, but symbolizing
+ * the stacks uses lazily-built DWARF data that's not safe to share between
+ * threads, so we do that, and format the output, under a single lock. The
+ * output for each process is buffered, and written in order of PID.
+ */
+void
+fleet(const std::vector<pid_t> &pids, unsigned workers, Dwarf::ImageCache &imageCache,
+      std::ostream &os, const PstackOptions &options)
+{
+    std::mutex printLock;
+    std::vector<std::string> outputs(pids.size());
+    std::vector<bool> done(pids.size());
+    size_t nextOutput = 0;
+    std::atomic<size_t> next(0);
+
+    auto worker = [&] () {
+        for (size_t i; !interrupted && (i = next++) < pids.size(); ) {
+            std::ostringstream buf;
+            // Declared first, so the stacks and process are destroyed
+            // while it's held: they refer to shared DWARF data.
+            std::unique_lock<std::mutex> guard(printLock, std::defer_lock);
+            try {
+                Elf::Object::sptr exec;
+                LiveProcess proc(exec, pids[i], PathReplacementList(), imageCache);
+                proc.load(options);
+                std::list<ThreadStack> threadStacks;
+                collectStacks(proc, threadStacks);
+                guard.lock();
+                printStacks(proc, buf, threadStacks, options);
+            }
+            catch (const std::exception &e) {
+                if (!guard.owns_lock())
+                    guard.lock();
+                std::cerr << "failed to process " << pids[i] << ": " << e.what() << "\n";
+            }
+            if (!guard.owns_lock())
+                guard.lock();
+            outputs[i] = buf.str();
+            done[i] = true;
+            for (; nextOutput < pids.size() && done[nextOutput]; ++nextOutput) {
+                os << outputs[nextOutput];
+                outputs[nextOutput] = std::string();
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(size_t(workers), pids.size()); ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+    os.flush();
+}
+
+/*
+ * Samples from the stacks of all threads, aggregated in a trie keyed by
+ * instruction address, from the outermost frame in. Each node counts the
+ * samples whose innermost frame it is.
+ */
+class StackTrie {
+    struct Node {
+        Elf::Addr pc;
+        unsigned long count;
+        std::map<Elf::Addr, size_t> children; // indexes in "nodes"
+        Node(Elf::Addr pc_) : pc(pc_), count(0) {}
+    };
+    std::vector<Node> nodes; // nodes[0] is the root, and has no address.
+    void fold(Process &, size_t node, const std::string &prefix,
+          std::unordered_map<Elf::Addr, std::string> &names,
+          std::map<std::string, unsigned long> &folded) const;
+public:
+    StackTrie() : nodes(1, Node(0)) {}
+    void add(const ThreadStack &);
+    // Write each distinct stack with its count, in "folded" format: the
+    // function names, outermost first, separated by semicolons.
+    std::ostream &printFolded(Process &, std::ostream &) const;
+};
+
+void
+StackTrie::add(const ThreadStack &thread)
+{
+    size_t node = 0;
+    for (auto frame = thread.stack.rbegin(); frame != thread.stack.rend(); ++frame) {
+        auto pc = frame->scopeIP();
+        auto it = nodes[node].children.find(pc);
+        if (it == nodes[node].children.end()) {
+            it = nodes[node].children.emplace(pc, nodes.size()).first;
+            nodes.emplace_back(pc);
+        }
+        node = it->second;
+    }
+    nodes[node].count++;
+}
+
+void
+StackTrie::fold(Process &proc, size_t node, const std::string &prefix,
+      std::unordered_map<Elf::Addr, std::string> &names,
+      std::map<std::string, unsigned long> &folded) const
+{
+    for (const auto &child : nodes[node].children) {
+        // Each address is only symbolized once, however many stacks it's on.
+        auto pc = child.first;
+        auto name = names.find(pc);
+        if (name == names.end()) {
+            std::string joined;
+            for (const auto &function : proc.functionNames(pc))
+                joined += (joined.empty() ? "" : ";") + function;
+            name = names.emplace(pc, joined).first;
+        }
+        auto stack = prefix.empty() ? name->second : prefix + ";" + name->second;
+        if (nodes[child.second].count != 0)
+            folded[stack] += nodes[child.second].count;
+        fold(proc, child.second, stack, names, folded);
+    }
+}
+
+std::ostream &
+StackTrie::printFolded(Process &proc, std::ostream &os) const
+{
+    // Different addresses may give the same stack of names: merge them.
+    std::unordered_map<Elf::Addr, std::string> names;
+    std::map<std::string, unsigned long> folded;
+    fold(proc, 0, "", names, folded);
+    for (const auto &stack : folded)
+        os << stack.first << " " << stack.second << "\n";
+    return os;
+}
+
+/*
+ * Sample the stacks of all threads at sampleRate samples per second for
+ * sampleDuration seconds, or until interrupted. Write the aggregated stacks
+ * in folded format to "os", and the number of samples of each thread to
+ * the log.
+ */
+void
+profile(Process &proc, std::ostream &os)
+{
+    StackTrie trie;
+    std::map<lwpid_t, unsigned long> threadSamples;
+    unsigned long samples = 0;
+
+    using clock = std::chrono::steady_clock;
+    auto interval = std::chrono::duration_cast<clock::duration>(
+          std::chrono::duration<double>(1.0 / sampleRate));
+    auto start = clock::now();
+    auto end = start + std::chrono::duration_cast<clock::duration>(
+          std::chrono::duration<double>(sampleDuration));
+    bool live = dynamic_cast<LiveProcess *>(&proc) != nullptr;
+    for (auto next = start; !interrupted && (sampleDuration == 0 || next < end); next += interval) {
+        std::this_thread::sleep_until(next);
+        // If we've fallen behind, don't try to catch up.
+        next = std::max(next, clock::now() - interval);
+        if (live && kill(proc.getPID(), 0) == -1 && errno == ESRCH) {
+            std::clog << "process " << proc.getPID() << " has exited\n";
+            break;
+        }
+        std::list<ThreadStack> threadStacks;
+        collectStacks(proc, threadStacks);
+        // Threads we couldn't unwind at all aren't samples of anything.
+        threadStacks.remove_if([] (const ThreadStack &thread) { return thread.stack.empty(); });
+        if (threadStacks.empty()) {
+            std::clog << "no threads left to sample in process " << proc.getPID() << "\n";
+            break;
+        }
+        for (const auto &thread : threadStacks) {
+            trie.add(thread);
+            threadSamples[thread.info.ti_lid]++;
+        }
+        samples++;
+        // A core never changes, so one sample is all it has to give.
+        if (!live)
+            break;
+    }
+    trie.printFolded(proc, os);
+    std::clog << samples << " samples in " << std::chrono::duration<double>(clock::now() - start).count()
+        << " seconds\n";
+    for (const auto &thread : threadSamples)
+        std::clog << "lwp " << thread.first << ": " << thread.second << " samples\n";
+}
+
 template<int V> bool doPy(Process &proc, std::ostream &o, const PstackOptions &options) {
     try {
         PythonPrinter<V> printer(proc, o, options);
@@ -108,13 +464,26 @@ emain(int argc, char **argv)
 #endif
     bool coreOnExit = false;
 
-    while ((c = getopt(argc, argv, "F:b:d:CD:hjsVvag:ptz:")) != -1) {
+    while ((c = getopt(argc, argv, "F:b:c:d:CD:G:hjmP:r:sS:Vvag:I:ptu:w:z:")) != -1) {
         switch (c) {
         case 'F': g_openPrefix = optarg;
                   break;
         case 'g':
             Elf::globalDebugDirectories.add(optarg);
             break;
+        case 'I':
+            Elf::IndexCache::directory = optarg;
+            break;
+        case 'c': {
+            // <pages>[:<pagesize>]
+            char *end;
+            CacheReader::defaultMaxPages = strtoul(optarg, &end, 0);
+            if (*end == ':')
+                CacheReader::defaultPageSize = strtoul(end + 1, &end, 0);
+            if (*end != 0 || CacheReader::defaultMaxPages == 0 || CacheReader::defaultPageSize == 0)
+                return usage(argv[0]);
+            break;
+        }
         case 'D': {
             auto dumpobj = std::make_shared<Elf::Object>(imageCache, loadFile(optarg));
             auto di = std::make_shared<Dwarf::Info>(dumpobj, imageCache);
@@ -136,6 +505,32 @@ emain(int argc, char **argv)
         case 'j':
             doJson = true;
             break;
+        case 'm':
+            ProcessVMReader::enabled = false;
+            break;
+        case 'P':
+            fleetName = optarg;
+            break;
+        case 'G':
+            fleetCgroup = optarg;
+            break;
+        case 'w': {
+            char *end;
+            fleetWorkers = strtoul(optarg, &end, 0);
+            if (*end != 0 || fleetWorkers == 0)
+                return usage(argv[0]);
+            break;
+        }
+        case 'r': {
+            // <rate>[:<seconds>]
+            char *end;
+            sampleRate = strtod(optarg, &end);
+            if (*end == ':')
+                sampleDuration = strtod(end + 1, &end);
+            if (*end != 0 || sampleRate <= 0 || sampleDuration < 0)
+                return usage(argv[0]);
+            break;
+        }
         case 's':
             options.set(PstackOption::nosrc);
             break;
@@ -155,6 +550,23 @@ emain(int argc, char **argv)
         case 't':
             options.set(PstackOption::nothreaddb);
             break;
+        case 'u': {
+            char *end;
+            unwindThreads = strtoul(optarg, &end, 0);
+            if (*end != 0 || unwindThreads == 0)
+                return usage(argv[0]);
+            if (snapshotSize == 0)
+                snapshotSize = defaultSnapshotSize;
+            break;
+        }
+        case 'S': {
+            // size of stack snapshots, in KB.
+            char *end;
+            snapshotSize = strtoul(optarg, &end, 0) * 1024;
+            if (*end != 0 || snapshotSize == 0)
+                return usage(argv[0]);
+            break;
+        }
 
         case 'V':
             std::clog << STR(VERSION) << "\n";
@@ -167,6 +579,28 @@ emain(int argc, char **argv)
         }
     }
 
+    if (fleetName != "" || fleetCgroup != "") {
+        if (optind != argc || sampleRate != 0)
+            return usage(argv[0]);
+#if defined(WITH_PYTHON)
+        if (python)
+            return usage(argv[0]);
+#endif
+        while (!interrupted) {
+            try {
+                fleet(fleetPids(fleetName, fleetCgroup), fleetWorkers, imageCache, std::cout, options);
+            }
+            catch (const std::exception &e) {
+                std::cerr << "fleet: " << e.what() << "\n";
+                return EX_SOFTWARE;
+            }
+            if (sleepTime == 0.0)
+                break;
+            usleep(sleepTime * 1000000);
+        }
+        goto done;
+    }
+
     if (optind == argc)
         return usage(argv[0]);
 
@@ -175,6 +609,10 @@ emain(int argc, char **argv)
         try {
             auto doStack = [=, &options] (Process &proc) {
                 proc.load(options);
+                if (sampleRate != 0) {
+                    profile(proc, std::cout);
+                    return;
+                }
                 while (!interrupted) {
 #if defined(WITH_PYTHON)
                    if (python) {
@@ -235,10 +673,19 @@ usage(const char *name)
         "\t[-V]                         dump git tag of source\n"
         "\t[-s]                         don't include source-level details\n"
         "\t[-g]                         add global debug directory\n"
+        "\t[-I <dir>]                   cache indexes of ELF/DWARF content in <dir>\n"
         "\t[-a]                         show arguments to functions where possible\n"
         "\t[-n]                         don't try to find external debug images\n"
         "\t[-t]                         don't try to use the thread_db library\n"
+        "\t[-m]                         read process memory from /proc/<pid>/mem, not process_vm_readv\n"
         "\t[-b<n>]                      batch mode: repeat every 'n' seconds\n"
+        "\t[-r<rate>[:<secs>]]          sample stacks 'rate' times a second, and print folded stacks\n"
+        "\t[-S<kb>]                     copy 'kb' KB of each stack, and unwind after resuming the process\n"
+        "\t[-u<threads>]                unwind after resuming the process, on 'threads' threads\n"
+        "\t[-c<pages>[:<size>]]         size of the I/O page cache for each file\n"
+        "\t[-P<name>]                   examine all processes with command name 'name'\n"
+        "\t[-G<cgroup>]                 examine all processes in 'cgroup'\n"
+        "\t[-w<workers>]                with -P or -G, examine 'workers' processes at once\n"
 #ifdef WITH_PYTHON
         "\t[-p]                         print python backtrace if available\n"
 #endif
@@ -110,6 +110,20 @@ MemReader::describe(std::ostream &os) const
     os << descr;
 }
 
+void
+Reader::readBatch(Request *requests, size_t count) const
+{
+    for (size_t i = 0; i < count; ++i) {
+        auto &req = requests[i];
+        try {
+            req.result = read(req.offset, req.count, req.ptr);
+        }
+        catch (const std::exception &) {
+            req.result = 0;
+        }
+    }
+}
+
 std::string
 Reader::readString(off_t offset) const
 {
@@ -138,83 +152,157 @@ FileReader::read(off_t off, size_t count, char *ptr) const
     return rc;
 }
 
+size_t CacheReader::defaultPageSize = 4096;
+size_t CacheReader::defaultMaxPages = 256;
+
 void
-CacheReader::Page::load(const Reader &r, off_t offset_)
+CacheReader::Page::load(const Reader &r, off_t offset_, size_t pageSize)
 {
-    assert(offset_ % PAGESIZE == 0);
+    assert(offset_ % pageSize == 0);
+    offset = offset_;
     try {
-        len = r.read(offset_, PAGESIZE, data);
-        offset = offset_;
+        len = r.read(offset_, pageSize, data.get());
     }
     catch (std::exception &ex) {
         len = 0;
     }
 }
 
-CacheReader::CacheReader(Reader::csptr upstream_)
+CacheReader::CacheReader(Reader::csptr upstream_, size_t pageSize_, size_t maxPages_)
     : upstream(move(upstream_))
+    , pageSize(pageSize_)
+    , maxPages(maxPages_)
+    , hits(0)
+    , misses(0)
 {
+    if (pageSize == 0 || maxPages == 0)
+        throw (Exception() << "invalid cache geometry for " << *upstream
+              << ": " << maxPages << " pages of " << pageSize << " bytes");
 }
 
 void
 CacheReader::flush() {
-    std::list<Page *> clearpages;
-    std::swap(pages, clearpages);
-    for (auto &i : clearpages)
-        delete i;
+    std::lock_guard<std::mutex> guard(lock);
+    pageIndex.clear();
+    pages.clear();
 }
 
 CacheReader::~CacheReader()
 {
-    flush();
+    if (verbose >= 2 && hits + misses != 0)
+        *debug << "page cache for " << *upstream << ": lookups: " << hits + misses
+            << ", hits=" << hits << ", pages=" << pages.size() << "/" << maxPages
+            << " of " << pageSize << " bytes" << std::endl;
 }
 
-CacheReader::Page *
-CacheReader::getPage(off_t pageoff) const
+// Find a page for pageoff at the front of the cache, and index it. The
+// caller loads its content.
+CacheReader::Page &
+CacheReader::newPage(off_t pageoff) const
 {
-    Page *p;
-    bool first = true;
-    for (auto i = pages.begin(); i != pages.end(); ++i) {
-        p = *i;
-        if (p->offset == pageoff) {
-            // move page to front.
-            if (!first) {
-                pages.erase(i);
-                pages.push_front(p);
-            }
-            return p;
-        }
-        first = false;
-    }
-    if (pages.size() == MAXPAGES) {
-        p = pages.back();
-        pages.pop_back();
+    misses++;
+    if (pages.size() >= maxPages) {
+        // recycle the least-recently used page.
+        pages.splice(pages.begin(), pages, std::prev(pages.end()));
+        pageIndex.erase(pages.front().offset);
     } else {
-        p = new Page();
+        pages.emplace_front(pageSize);
     }
-    p->load(*upstream, pageoff);
-    pages.push_front(p);
+    auto &p = pages.front();
+    p.offset = pageoff;
+    pageIndex[pageoff] = pages.begin();
+    return p;
+}
+
+const CacheReader::Page &
+CacheReader::getPage(off_t pageoff) const
+{
+    auto idx = pageIndex.find(pageoff);
+    if (idx != pageIndex.end()) {
+        // move page to front.
+        hits++;
+        pages.splice(pages.begin(), pages, idx->second);
+        return *idx->second;
+    }
+    auto &p = newPage(pageoff);
+    p.load(*upstream, pageoff, pageSize);
     return p;
 }
 
 size_t
 CacheReader::read(off_t off, size_t count, char *ptr) const
+{
+    // Large reads gain nothing from the cache, and would evict everything
+    // else from it: read them directly.
+    if (count >= pageSize * 4)
+        return upstream->read(off, count, ptr);
+    std::lock_guard<std::mutex> guard(lock);
+    return readCached(off, count, ptr);
+}
+
+void
+CacheReader::readBatch(Request *requests, size_t count) const
+{
+    // Requests we pass directly upstream: large ones, as for read, and the
+    // pages we need for the others that we don't have cached yet. We make
+    // these in a single batch. For each, we note where its result goes:
+    // the direct request, or the page, in the same order.
+    std::vector<Request> upstreamRequests;
+    std::vector<std::pair<Request *, Page *>> destinations;
+    size_t loading = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < count; ++i) {
+        auto &req = requests[i];
+        if (req.count >= pageSize * 4) {
+            upstreamRequests.push_back(req);
+            destinations.emplace_back(&req, nullptr);
+            continue;
+        }
+        for (off_t pageoff = req.offset - req.offset % pageSize;
+                pageoff < off_t(req.offset + req.count); pageoff += pageSize) {
+            // Don't load more pages than we can hold: the excess can load on demand.
+            if (pageIndex.find(pageoff) != pageIndex.end() || loading == maxPages)
+                continue;
+            auto &page = newPage(pageoff);
+            upstreamRequests.push_back(Request{ pageoff, pageSize, page.data.get(), 0 });
+            destinations.emplace_back(nullptr, &page);
+            loading++;
+        }
+    }
+    if (!upstreamRequests.empty())
+        upstream->readBatch(upstreamRequests.data(), upstreamRequests.size());
+    for (size_t i = 0; i < upstreamRequests.size(); ++i) {
+        auto result = upstreamRequests[i].result;
+        if (destinations[i].first)
+            destinations[i].first->result = result;
+        else
+            destinations[i].second->len = std::min(result, pageSize);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        auto &req = requests[i];
+        if (req.count < pageSize * 4)
+            req.result = readCached(req.offset, req.count, req.ptr);
+    }
+}
+
+size_t
+CacheReader::readCached(off_t off, size_t count, char *ptr) const
 {
     off_t startoff = off;
     for (;;) {
         if (count == 0)
             break;
-        size_t offsetOfDataInPage = off % PAGESIZE;
+        size_t offsetOfDataInPage = off % pageSize;
         off_t offsetOfPageInFile = off - offsetOfDataInPage;
-        Page *page = getPage(offsetOfPageInFile);
-        if (page == nullptr)
+        const Page &page = getPage(offsetOfPageInFile);
+        if (page.len <= offsetOfDataInPage)
             break;
-        size_t chunk = std::min(page->len - offsetOfDataInPage, count);
-        memcpy(ptr, page->data + offsetOfDataInPage, chunk);
+        size_t chunk = std::min(page.len - offsetOfDataInPage, count);
+        memcpy(ptr, page.data.get() + offsetOfDataInPage, chunk);
         off += chunk;
         count -= chunk;
         ptr += chunk;
-        if (page->len != PAGESIZE)
+        if (page.len != pageSize)
             break;
     }
     return off - startoff;
@@ -223,9 +311,18 @@ CacheReader::read(off_t off, size_t count, char *ptr) const
 string
 CacheReader::readString(off_t off) const
 {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = stringCache.find(off);
+        if (it != stringCache.end())
+            return it->second.value;
+    }
+    // Reading the string takes the lock for each read, so we can't hold it here.
+    auto value = Reader::readString(off);
+    std::lock_guard<std::mutex> guard(lock);
     auto &entry = stringCache[off];
     if (entry.isNew) {
-        entry.value = Reader::readString(off);
+        entry.value = std::move(value);
         entry.isNew = false;
     }
     return entry.value;
@@ -0,0 +1,109 @@
+#!/usr/bin/python2
+# Check canal finds the objects in a core, the references to one of them, and
+# strings, including those across the boundaries of the chunks it scans. Then
+# check it finds the same in a live process.
+
+import coremonitor
+import subprocess
+import tempfile
+
+cm = coremonitor.CoreMonitor(["tests/vtables"])
+lines = cm.input.splitlines()
+first, ref = [ int(addr, 16) for addr in lines[0].split() ]
+buf, size = [ int(word, 0) for word in lines[1].split() ]
+
+# Run canal on the core, or on "target", if given.
+def canal(*args, **kwargs):
+    target = kwargs.get("target", cm.core())
+    return subprocess.check_output(["./canal"] + list(args) + ["tests/vtables", target])
+
+def countsOf(text):
+    counts = {}
+    for line in text.splitlines():
+        words = line.split()
+        counts[words[1]] = int(words[0])
+    return counts
+
+counts = countsOf(canal())
+assert counts["_ZTV5Small"] == 3000
+assert counts["_ZTV6Medium"] == 1000
+assert counts["_ZTV5Large"] == 60
+
+# With -H, each heap object's size comes from its malloc chunk's header,
+# and we get a histogram of the sizes. Objects in loaded ELF objects, like
+# libstdc++'s typeinfo, aren't in malloc chunks at all.
+def sizesOf(text):
+    sizes = {}
+    for line in text.splitlines():
+        if line.startswith("\t"):
+            sizes[symbol].append(line.strip())
+        else:
+            symbol = line.split()[1]
+            sizes[symbol] = []
+    return sizes
+
+sizes = sizesOf(canal("-H"))
+assert sizes["_ZTV5Small"] == [ "96000 bytes in 3000 malloc chunks", "32-63 bytes: 3000" ]
+assert sizes["_ZTV6Medium"] == [ "128000 bytes in 1000 malloc chunks", "128-255 bytes: 1000" ]
+assert sizes["_ZTV5Large"] == [ "181440 bytes in 60 malloc chunks", "2048-4095 bytes: 60" ]
+typeinfo = [ lines for symbol, lines in sizes.items() if "cxxabiv1" in symbol ]
+assert typeinfo
+for lines in typeinfo:
+    assert lines[0].startswith("0 bytes in 0 malloc chunks")
+
+# The object's only referenced from the vector, whether we look for its
+# address, or a range that covers the whole object.
+def refs(*args, **kwargs):
+    return [ int(line.split()[0], 16) for line in canal(*args, **kwargs).splitlines() ]
+assert refs("-f", hex(first)) == [ ref ]
+assert refs("-f", hex(first - 8), "-e", hex(first + 16)) == [ ref ]
+
+# Likewise from a file of ranges, where the others don't cover anything.
+with tempfile.NamedTemporaryFile() as ranges:
+    for i in range(1000):
+        base = 0x100000000000 + i * 0x10000
+        ranges.write("%#x %#x\n" % (base, base + 0x100))
+    ranges.write("%#x %#x\n" % (first, first + 16))
+    ranges.flush()
+    assert refs("-R", ranges.name) == [ ref ]
+
+# The strings in the buffer are at 6 bytes before each page boundary in it.
+def acrossPages(buf, size):
+    return [ page - 6 for page in range((buf + 4095) & ~4095, buf + size - 7, 4096)
+          if page - 6 >= buf ]
+across = acrossPages(buf, size)
+
+def strings(*args):
+    found = {}
+    for line in canal(*args).splitlines():
+        addr, string = line.split()
+        found.setdefault(string, []).append(int(addr, 16))
+    return found
+
+# One string is found with memmem, and several at once with Aho-Corasick,
+# which also shows which string it found.
+assert sorted(refs("-S", "needle-across")) == across
+found = strings("-S", "needle-one", "-S", "needle-two", "-S", "needle-across")
+assert len(found["needle-one"]) == 30
+assert len(found["needle-two"]) == 20
+assert sorted(found["needle-across"]) == across
+
+# A live copy of the program has the same objects, which we find from its
+# mappings, whether we stop it while we scan, or not.
+live = subprocess.Popen(["tests/vtables", "live"],
+      stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+try:
+    live.stdout.readline()
+    liveBuf, liveSize = [ int(word, 0) for word in live.stdout.readline().split() ]
+    pid = str(live.pid)
+    classes = [ "_ZTV5Small", "_ZTV6Medium", "_ZTV5Large" ]
+    for args in [ [], [ "-F" ] ]:
+        liveCounts = countsOf(canal(*args, target=pid))
+        assert [ liveCounts[c] for c in classes ] == [ counts[c] for c in classes ]
+        liveSizes = sizesOf(canal("-H", *args, target=pid))
+        assert [ liveSizes[c] for c in classes ] == [ sizes[c] for c in classes ]
+        found = sorted(refs("-S", "needle-across", *args, target=pid))
+        assert found == acrossPages(liveBuf, liveSize)
+finally:
+    live.stdin.close()
+    live.wait()
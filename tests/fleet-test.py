@@ -0,0 +1,90 @@
+#!/usr/bin/python2
+
+# Examine many copies of the same program at once in fleet mode, so the
+# workers all race to load the same images into the shared caches, and check
+# the stacks match those from examining each process on its own.
+#
+# The copies run from a copy of the program with a unique name, so -P finds
+# only them, and, where we can make one, in a cgroup of their own for -G.
+
+import binascii
+import json
+import os
+import shutil
+import subprocess
+import tempfile
+
+# Process names are at most 15 characters.
+name = "fleet-" + binascii.hexlify(os.urandom(4))
+tmp = tempfile.mkdtemp()
+prog = os.path.join(tmp, name)
+shutil.copy("tests/fleet", prog)
+
+def makeCgroup():
+    for hierarchy in [ "/sys/fs/cgroup", "/sys/fs/cgroup/unified", "/sys/fs/cgroup/pids" ]:
+        cgroup = os.path.join(hierarchy, name)
+        try:
+            os.mkdir(cgroup)
+        except OSError:
+            continue
+        # If it's a cgroup, the kernel made its cgroup.procs.
+        if not os.path.exists(os.path.join(cgroup, "cgroup.procs")):
+            os.rmdir(cgroup)
+            continue
+        try:
+            for proc in procs:
+                with open(os.path.join(cgroup, "cgroup.procs"), "w") as f:
+                    f.write("%d\n" % proc.pid)
+            return cgroup
+        except (IOError, OSError):
+            # Can't put processes in cgroups of this hierarchy.
+            os.rmdir(cgroup)
+    return None
+
+copies = 24
+procs = [ subprocess.Popen([prog], stdout=subprocess.PIPE)
+      for _ in range(copies) ]
+cgroup = None
+try:
+    pids = set()
+    for proc in procs:
+        assert proc.stdout.readline().startswith("ready")
+        pids.add(proc.pid)
+
+    def stacks(text):
+        # fleet mode emits one JSON array per process.
+        decoder = json.JSONDecoder()
+        result = []
+        text = text.strip()
+        while text:
+            obj, end = decoder.raw_decode(text)
+            result.append(obj)
+            text = text[end:].strip()
+        return result
+
+    serial = []
+    for pid in sorted(pids):
+        threads = stacks(subprocess.check_output(["./pstack", "-j", str(pid)]))[0]
+        assert len(threads) == 5
+        serial.append(threads)
+
+    # Fleet mode lists processes in PID order, like we have for "serial".
+    for _ in range(5):
+        fleet = stacks(subprocess.check_output(
+            ["./pstack", "-j", "-w", "16", "-P", name]))
+        assert fleet == serial
+
+    cgroup = makeCgroup()
+    if cgroup:
+        fleet = stacks(subprocess.check_output(
+            ["./pstack", "-j", "-w", "16", "-G", cgroup]))
+        assert fleet == serial
+    else:
+        print("can't create a cgroup: not testing -G")
+finally:
+    for proc in procs:
+        proc.kill()
+        proc.wait()
+    if cgroup:
+        os.rmdir(cgroup)
+    shutil.rmtree(tmp)
@@ -0,0 +1,38 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <iostream>
+
+// Live process for fleet-test.py: a few threads that stop in pause(), and a
+// line on stdout once they're all there.
+pthread_mutex_t l = PTHREAD_MUTEX_INITIALIZER;
+int in_entry;
+pthread_cond_t c = PTHREAD_COND_INITIALIZER;
+const int threads = 4;
+
+extern "C" {
+void *
+entry(void *)
+{
+   pthread_mutex_lock(&l);
+   in_entry++;
+   pthread_cond_signal(&c);
+   pthread_mutex_unlock(&l);
+   pause();
+   return nullptr;
+}
+}
+
+int
+main(int /*unused*/, char ** /*unused*/)
+{
+   for (int i = 0; i < threads; i++) {
+      pthread_t tid;
+      pthread_create(&tid, nullptr, entry, nullptr);
+   }
+   pthread_mutex_lock(&l);
+   while (in_entry != threads)
+      pthread_cond_wait(&c, &l);
+   pthread_mutex_unlock(&l);
+   std::cout << "ready " << getpid() << std::endl;
+   pause();
+}
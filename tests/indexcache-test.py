@@ -0,0 +1,44 @@
+#!/usr/bin/python2
+# Check indexes in the index cache (pstack -I) built from a separate debug
+# file aren't used when that file's not there, and the other way around.
+
+import coremonitor
+import os
+import shutil
+import subprocess
+import tempfile
+
+tmp = tempfile.mkdtemp()
+try:
+    # A stripped copy of a program, with its debug info in a separate file,
+    # where "-g <tmp>/debug" will find it by its build-id.
+    prog = os.path.join(tmp, "cpp")
+    shutil.copy("tests/cpp", prog)
+    notes = subprocess.check_output(["readelf", "-n", prog])
+    buildid = [ line.split()[-1] for line in notes.splitlines() if "Build ID" in line ][0]
+    debugdir = os.path.join(tmp, "debug", ".build-id", buildid[:2])
+    os.makedirs(debugdir)
+    debugfile = os.path.join(debugdir, buildid[2:] + ".debug")
+    subprocess.check_call(["objcopy", "--only-keep-debug", prog, debugfile])
+    subprocess.check_call(["strip", "-g", "-s", prog])
+    subprocess.check_call(["objcopy", "--add-gnu-debuglink=" + debugfile, prog])
+
+    cm = coremonitor.CoreMonitor([prog])
+    cache = os.path.join(tmp, "cache")
+
+    def pstack(*args):
+        return subprocess.check_output(["./pstack"] + list(args) + [prog, cm.core()])
+
+    withDebug = pstack("-g", os.path.join(tmp, "debug"))
+    withoutDebug = pstack()
+    assert "Foo::Bar::baz" in withDebug
+    assert "Foo::Bar::baz" not in withoutDebug
+
+    # Fill the cache with the debug file there, then use it without, and
+    # the other way around.
+    for _ in range(2):
+        assert pstack("-I", cache, "-g", os.path.join(tmp, "debug")) == withDebug
+        assert pstack("-I", cache) == withoutDebug
+    assert os.listdir(cache)
+finally:
+    shutil.rmtree(tmp)
@@ -0,0 +1,60 @@
+#include "libpstack/util.h"
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Check a CacheReader gives the right results for a batch that mixes large
+// reads, which it passes straight through, with small ones it reads through
+// its pages, in either order.
+
+static char
+expected(size_t off)
+{
+    return char(off * 7 + off / 251);
+}
+
+int
+main()
+{
+    const size_t pageSize = 4096, size = 1024 * 1024;
+    std::vector<char> content(size);
+    for (size_t i = 0; i < size; ++i)
+        content[i] = expected(i);
+    auto cache = std::make_shared<CacheReader>(
+            std::make_shared<MemReader>("test content", size, content.data()), pageSize, 16);
+
+    // offset, and count. The last runs past the end of the content.
+    const std::pair<off_t, size_t> reads[] = {
+        { 100, 200 },
+        { 3 * pageSize + 3, 4 * pageSize + 5 },
+        { 30000, 5000 },
+        { 0, 16 * pageSize },
+        { 20 * pageSize - 10, 20 },
+        { size - 100, 4 * pageSize },
+        { size - 50, 100 },
+    };
+    std::vector<std::vector<char>> buffers;
+    std::vector<Reader::Request> batch;
+    for (auto &read : reads) {
+        buffers.emplace_back(read.second);
+        batch.push_back(Reader::Request{ read.first, read.second, buffers.back().data(), 0 });
+    }
+    cache->readBatch(batch.data(), batch.size());
+
+    int failures = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        auto &req = batch[i];
+        size_t want = std::min(req.count, size - req.offset);
+        bool ok = req.result == want;
+        for (size_t j = 0; ok && j < want; ++j)
+            ok = req.ptr[j] == expected(req.offset + j);
+        if (!ok) {
+            std::cerr << "read of " << req.count << " bytes at " << req.offset
+                << " gave " << req.result << " bytes, wanted " << want << "\n";
+            failures++;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+// Objects for canal to find: known numbers of instances of a few classes,
+// and of a few strings.
+struct Base { virtual ~Base() {} };
+struct Small : Base { int x; };
+struct Medium : Base { char pad[100]; };
+struct Large : Base { char pad[3000]; };
+
+// Write "upper" in lower case at "p", so the string canal searches for is
+// nowhere else in the process, like our .rodata.
+static void
+lower(char *p, const char *upper)
+{
+    while ((*p++ = tolower(*upper++)) != 0)
+        ;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const int smalls = 3000, mediums = 1000, larges = 60;
+    std::vector<Base *> objects;
+    // Don't leave stale copies of the pointers in freed storage.
+    objects.reserve(smalls + mediums + larges);
+    for (int i = 0; i < smalls; ++i) {
+        objects.push_back(new Small);
+        if (i % 3 == 0)
+            objects.push_back(new Medium);
+        if (i % 50 == 0)
+            objects.push_back(new Large);
+    }
+    for (int i = 0; i < 30; ++i)
+        lower((char *)malloc(32), "NEEDLE-ONE");
+    for (int i = 0; i < 20; ++i)
+        lower((char *)malloc(32), "NEEDLE-TWO");
+
+    // A buffer bigger than canal's scan chunks, with a string across each
+    // page boundary in it, so some will be across a chunk boundary.
+    const size_t size = 40 * 1024 * 1024;
+    char *buf = (char *)calloc(size, 1);
+    for (uintptr_t page = ((uintptr_t)buf + 4095) & ~4095UL;
+          page + 8 <= (uintptr_t)buf + size; page += 4096)
+        lower((char *)page - 6, "NEEDLE-ACROSS");
+
+    // Tell the test where the first object is, and where we point to it,
+    // then where the buffer is.
+    printf("%p %p\n", (void *)objects[0], (void *)&objects[0]);
+    printf("%p %zu\n", (void *)buf, size);
+    fflush(stdout);
+
+    // With "live", wait for our input to close, so the test can examine us
+    // while we run, rather than dump core.
+    if (argc > 1 && strcmp(argv[1], "live") == 0) {
+        char c;
+        while (read(0, &c, 1) > 0)
+            ;
+        return 0;
+    }
+    abort();
+}